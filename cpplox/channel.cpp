@@ -0,0 +1,387 @@
+#include "channel.h"
+
+#include <algorithm>
+#include <bit>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "class.h"
+#include "collection.h"
+#include "float64_array.h"
+#include "vm.h"
+
+bool Message::Pack(Value value, Message* message) {
+  std::vector<Object*> enclosing;
+  return Pack(value, message, &enclosing);
+}
+
+Value Message::Unpack(VM* vm) {
+  std::vector<Object*> enclosing;
+  return Unpack(vm, &enclosing);
+}
+
+bool Message::Pack(Value value, Message* message, std::vector<Object*>* enclosing) {
+  message->kind = Kind::Value;
+  message->value = value;
+
+  if (!std::holds_alternative<Object*>(value)) return true;
+
+  auto object = std::get<Object*>(value);
+
+  // an object that contains itself, directly or through what it contains
+  if (auto iter = std::find(enclosing->rbegin(), enclosing->rend(), object); iter != enclosing->rend()) {
+    message->kind = Kind::Enclosing;
+    message->value = static_cast<double>(iter - enclosing->rbegin());
+    return true;
+  }
+
+  switch (object->type) {
+    case ObjectType::String:
+      // a shared program's strings outlive every VM running it
+      if (!object->is_immortal) {
+        auto string = reinterpret_cast<String*>(object);
+        message->kind = Kind::String;
+        message->text.assign(string->content, string->length);
+      }
+      return true;
+
+    case ObjectType::Function:
+      return true;
+
+    case ObjectType::Closure: {
+      auto closure = reinterpret_cast<Closure*>(object);
+
+      // a shared program's capture-free closures are shared like its strings
+      if (closure->is_immortal) return true;
+
+      message->kind = Kind::Closure;
+      message->value = closure->func;
+
+      std::vector<Value> values;
+      for (auto upvalue : closure->Upvalues()) values.push_back(*upvalue->location);
+      values.insert(values.end(), closure->Captured().begin(), closure->Captured().end());
+      return PackParts(object, values, message, enclosing);
+    }
+
+    case ObjectType::List:
+      message->kind = Kind::List;
+      return PackParts(object, reinterpret_cast<List*>(object)->values, message, enclosing);
+
+    case ObjectType::Map: {
+      message->kind = Kind::Map;
+
+      std::vector<Value> values;
+      reinterpret_cast<Map*>(object)->table.ForEach([&values](const HashTable::Entry& entry) {
+        values.push_back(entry.key);
+        values.push_back(entry.value);
+      });
+      return PackParts(object, values, message, enclosing);
+    }
+
+    case ObjectType::Float64Array: {
+      auto array = reinterpret_cast<Float64Array*>(object);
+      message->kind = Kind::Float64Array;
+      message->numbers.assign(array->data, array->data + array->length);
+      return true;
+    }
+
+    // the class travels as it is, like a function, and the fields are copied
+    case ObjectType::Instance: {
+      auto instance = reinterpret_cast<Instance*>(object);
+      message->kind = Kind::Instance;
+      message->value = instance->shape->klass;
+      message->shape = instance->shape;
+      return PackParts(object, instance->fields, message, enclosing);
+    }
+
+    case ObjectType::NativeFunction:
+      // every VM registers its own natives, so they are found by name, but
+      // foreign functions are only bound where a script asked for them
+      if (reinterpret_cast<NativeFunction*>(object)->foreign != nullptr) return false;
+      message->kind = Kind::Native;
+      message->text = reinterpret_cast<NativeFunction*>(object)->name->GetString();
+      return true;
+
+    case ObjectType::Channel:
+    case ObjectType::Class:
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+bool Message::PackParts(Object* object, const std::vector<Value>& values, Message* message,
+                        std::vector<Object*>* enclosing) {
+  message->parts.resize(values.size());
+
+  enclosing->push_back(object);
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (!Pack(values[i], &message->parts[i], enclosing)) return false;
+  }
+  enclosing->pop_back();
+  return true;
+}
+
+Value Message::Unpack(VM* vm, std::vector<Object*>* enclosing) {
+  switch (kind) {
+    case Kind::Value:
+      return value;
+
+    case Kind::String:
+      return vm->AllocateString(text);
+
+    case Kind::Closure: {
+      auto closure = Closure::New(reinterpret_cast<Function*>(std::get<Object*>(value)));
+      vm->InsertObject(closure);
+
+      enclosing->push_back(closure);
+      for (size_t i = 0; i < closure->upvalue_count; ++i) {
+        auto upvalue = new Upvalue(nullptr);
+        upvalue->closed = parts[i].Unpack(vm, enclosing);
+        upvalue->location = &upvalue->closed;
+        vm->InsertObject(upvalue);
+
+        closure->Upvalues()[i] = upvalue;
+      }
+      for (size_t i = 0; i < closure->captured_count; ++i) {
+        closure->Captured()[i] = parts[closure->upvalue_count + i].Unpack(vm, enclosing);
+      }
+      enclosing->pop_back();
+      return closure;
+    }
+
+    case Kind::List: {
+      auto list = new List;
+      vm->InsertObject(list);
+
+      enclosing->push_back(list);
+      list->values.reserve(parts.size());
+      for (auto& part : parts) list->values.push_back(part.Unpack(vm, enclosing));
+      enclosing->pop_back();
+      return list;
+    }
+
+    case Kind::Map: {
+      auto map = new Map;
+      vm->InsertObject(map);
+
+      enclosing->push_back(map);
+      for (size_t i = 0; i + 1 < parts.size(); i += 2) {
+        auto key = parts[i].Unpack(vm, enclosing);
+        map->table.Insert(key, parts[i + 1].Unpack(vm, enclosing));
+      }
+      enclosing->pop_back();
+      return map;
+    }
+
+    case Kind::Float64Array: {
+      auto array = new Float64Array(numbers.size());
+      vm->InsertObject(array);
+      std::copy(numbers.begin(), numbers.end(), array->data);
+      return array;
+    }
+
+    case Kind::Instance: {
+      auto instance = new Instance(AsClass(value));
+      vm->InsertObject(instance);
+      instance->shape = shape;
+
+      enclosing->push_back(instance);
+      instance->fields.reserve(parts.size());
+      for (auto& part : parts) instance->fields.push_back(part.Unpack(vm, enclosing));
+      enclosing->pop_back();
+      return instance;
+    }
+
+    case Kind::Enclosing:
+      return enclosing->rbegin()[static_cast<size_t>(AsNumber(value))];
+
+    case Kind::Native: {
+      Value native;
+      auto name = AsString(vm->AllocateString(text));
+      if (vm->GetGlobal(name, &native)) return native;
+      return Nil{};
+    }
+  }
+  return Nil{};
+}
+
+Channel::Channel(size_t capacity) {
+  type = ObjectType::Channel;
+  is_immortal = true;
+
+  capacity = std::bit_ceil(std::max<size_t>(capacity, 2));
+  cells_ = std::make_unique<Cell[]>(capacity);
+  mask_ = capacity - 1;
+
+  for (size_t i = 0; i < capacity; ++i) {
+    cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+bool Channel::TryPush(Message& message) {
+  size_t position = enqueue_position_.load(std::memory_order_relaxed);
+  for (;;) {
+    auto& cell = cells_[position & mask_];
+    size_t sequence = cell.sequence.load(std::memory_order_acquire);
+    auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+    if (difference == 0) {
+      if (enqueue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        cell.message = std::move(message);
+        cell.sequence.store(position + 1, std::memory_order_release);
+        Changed();
+        return true;
+      }
+    } else if (difference < 0) {
+      // the cell still holds the message from a lap ago
+      return false;
+    } else {
+      position = enqueue_position_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+bool Channel::TryPop(Message* message) {
+  size_t position = dequeue_position_.load(std::memory_order_relaxed);
+  for (;;) {
+    auto& cell = cells_[position & mask_];
+    size_t sequence = cell.sequence.load(std::memory_order_acquire);
+    auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+
+    if (difference == 0) {
+      if (dequeue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        *message = std::move(cell.message);
+        cell.sequence.store(position + mask_ + 1, std::memory_order_release);
+        Changed();
+        return true;
+      }
+    } else if (difference < 0) {
+      return false;
+    } else {
+      position = dequeue_position_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+void Channel::Changed() {
+  changes_.fetch_add(1);
+  if (waiters_.load() > 0) changes_.notify_all();
+}
+
+void Channel::Push(Message& message) {
+  for (;;) {
+    uint32_t seen = changes_.load();
+    if (TryPush(message)) return;
+
+    waiters_++;
+    changes_.wait(seen);
+    waiters_--;
+  }
+}
+
+void Channel::Pop(Message* message) {
+  for (;;) {
+    uint32_t seen = changes_.load();
+    if (TryPop(message)) return;
+
+    waiters_++;
+    changes_.wait(seen);
+    waiters_--;
+  }
+}
+
+namespace {
+
+// channels are only freed at exit, VMs on any thread may still hold one
+std::mutex registry_lock;
+std::vector<std::unique_ptr<Channel>> channels;
+std::unordered_map<std::string, Channel*> named_channels;
+
+Channel* Register(size_t capacity) {
+  channels.push_back(std::make_unique<Channel>(capacity));
+  return channels.back().get();
+}
+
+constexpr int kSpins = 64;
+
+Channel* AsChannel(int argc, Value* argv) {
+  if (argc < 1 || !std::holds_alternative<Object*>(argv[0])) return nullptr;
+
+  auto object = std::get<Object*>(argv[0]);
+  return object->type == ObjectType::Channel ? reinterpret_cast<Channel*>(object) : nullptr;
+}
+
+// A fiber mustn't block its worker thread, a peer fiber may be queued
+// behind it: after spinning it is suspended and the call runs again later.
+// Anything else blocks.
+template <typename F>
+bool SpinOrRetry(VM* vm, F&& attempt) {
+  for (int i = 0; i < kSpins; ++i) {
+    if (attempt()) return true;
+    std::this_thread::yield();
+  }
+
+  if (vm->IsWorker()) {
+    vm->suspend = VM::Suspend::Retry;
+    return true;
+  }
+  return false;
+}
+
+Value NewChannel(VM* vm, int argc, Value* argv) {
+  std::lock_guard guard(registry_lock);
+
+  if (argc == 1 && IsNumber(argv[0])) return Register(AsNumber(argv[0]));
+
+  // the first VM to ask for a name decides its capacity
+  if (argc == 2 && IsString(argv[0]) && IsNumber(argv[1])) {
+    auto& channel = named_channels[AsString(argv[0])->GetString()];
+    if (channel == nullptr) channel = Register(AsNumber(argv[1]));
+    return channel;
+  }
+
+  return Nil{};
+}
+
+Value Send(VM* vm, int argc, Value* argv) {
+  auto channel = AsChannel(argc, argv);
+  Message message;
+  if (channel == nullptr || argc != 2 || !Message::Pack(argv[1], &message)) return false;
+
+  if (!SpinOrRetry(vm, [&]() { return channel->TryPush(message); })) channel->Push(message);
+  return true;
+}
+
+Value Recv(VM* vm, int argc, Value* argv) {
+  auto channel = AsChannel(argc, argv);
+  if (channel == nullptr) return Nil{};
+
+  Message message;
+  bool received = false;
+  if (!SpinOrRetry(vm, [&]() { return received = channel->TryPop(&message); })) {
+    channel->Pop(&message);
+    received = true;
+  }
+
+  return received ? message.Unpack(vm) : Nil{};
+}
+
+Value TryRecv(VM* vm, int argc, Value* argv) {
+  auto channel = AsChannel(argc, argv);
+  Message message;
+  if (channel == nullptr || !channel->TryPop(&message)) return Nil{};
+
+  return message.Unpack(vm);
+}
+
+}  // namespace
+
+void RegisterChannelNatives(VM* vm) {
+  vm->DefineNativeFunction("channel", &NewChannel);
+  vm->DefineNativeFunction("send", &Send, 2);
+  vm->DefineNativeFunction("recv", &Recv, 1);
+  vm->DefineNativeFunction("tryRecv", &TryRecv, 1);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "value.h"
+
+struct Shape;
+class VM;
+
+// A Value detached from the heap of the VM that sent it. Scalars, strings of
+// a shared program, functions and classes travel as they are; anything the
+// sender's heap owns is copied out and rebuilt in the receiver's heap. An
+// object reached twice arrives as two copies, unless it contains itself.
+struct Message {
+  // Enclosing is an object that contains itself, directly or through
+  // something it contains
+  enum class Kind : uint8_t { Value, String, Closure, List, Map, Float64Array, Instance, Native, Enclosing };
+
+  Kind kind{Kind::Value};
+  // the value itself, a closure's function, an instance's class, or for
+  // Enclosing how many objects out it is
+  Value value;
+  // a string's content, or a native's name
+  std::string text;
+  // a closure's upvalues, received closed, followed by its captured values;
+  // a list's elements; a map's keys and values in turn; an instance's fields
+  std::vector<Message> parts;
+  // a Float64Array's elements
+  std::vector<double> numbers;
+  // an instance's shape, which belongs to its class
+  Shape* shape{};
+
+  // false if value can't leave its VM (fibers, generators)
+  static bool Pack(Value value, Message* message);
+
+  Value Unpack(VM* vm);
+
+ private:
+  // enclosing holds the objects being packed or rebuilt, innermost last
+  static bool Pack(Value value, Message* message, std::vector<Object*>* enclosing);
+
+  // packs values as message's parts, inside object
+  static bool PackParts(Object* object, const std::vector<Value>& values, Message* message,
+                        std::vector<Object*>* enclosing);
+
+  Value Unpack(VM* vm, std::vector<Object*>* enclosing);
+};
+
+// A bounded multi-producer multi-consumer queue (Vyukov's ring: each cell
+// carries a sequence number telling producers and consumers whose turn it
+// is), so neither side takes a lock. Channels aren't on any heap: they live
+// until the process exits and can be used from any VM.
+struct Channel : Object {
+  explicit Channel(size_t capacity);
+
+  bool TryPush(Message& message);
+
+  bool TryPop(Message* message);
+
+  // block the calling thread until there is room or a message
+  void Push(Message& message);
+  void Pop(Message* message);
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    Message message;
+  };
+
+  void Changed();
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+
+  alignas(64) std::atomic<size_t> enqueue_position_{};
+  alignas(64) std::atomic<size_t> dequeue_position_{};
+
+  // bumped after every push and pop, a blocked caller waits for it to move
+  alignas(64) std::atomic<uint32_t> changes_{};
+  std::atomic<int> waiters_{};
+};
+
+// channel(capacity), channel(name, capacity), send(channel, value),
+// recv(channel) and tryRecv(channel)
+void RegisterChannelNatives(VM* vm);
@@ -1,50 +1,84 @@
 #include "chunk.h"
 
-#include "debug.h"
+#include <algorithm>
+#include <memory>
+#include <new>
+
 #include "opcode.h"
 
-void LineInfo::Append(int line) {
-  if (lines.size() > 0 && line == lines.back().number) {
-    lines.back().count++;
-  } else {
-    lines.push_back({line, 1});
+static void WriteVarint(std::vector<uint8_t>& out, uint32_t value) {
+  while (value >= 0x80) {
+    out.push_back((value & 0x7f) | 0x80);
+    value >>= 7;
   }
+  out.push_back(value);
 }
 
-int LineInfo::GetLine(int offset) {
-  int acc = 0;
-  for (int i = 0; i < lines.size(); ++i) {
-    acc += lines[i].count;
-    if (acc >= offset) {
-      return lines[i].number;
-    }
+static uint32_t ReadVarint(const uint8_t*& in) {
+  uint32_t value = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t byte = *in++;
+    value |= (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return value;
   }
-  assert(0);
 }
 
-bool LineInfo::IsInSameLine(int offset1, int offset2) {
-  int acc = 0;
-  for (int i = 0; i < lines.size(); ++i) {
-    acc += lines[i].count;
-    if (acc >= offset1) {
-      if (acc >= offset2)
-        return true;
-      else
-        return false;
-    }
-    if (acc >= offset2) {
-      if (acc >= offset1)
-        return true;
-      else
-        return false;
-    }
+static uint32_t ZigZag(int value) { return (static_cast<uint32_t>(value) << 1) ^ (value >> 31); }
+
+static int UnZigZag(uint32_t value) { return static_cast<int>(value >> 1) ^ -static_cast<int>(value & 1); }
+
+void LineInfo::Append(int line, int column) {
+  if (last_count_ > 0 && line == last_.line && column == last_.column) {
+    last_count_++;
+    return;
+  }
+
+  Flush();
+  last_ = {line, column};
+  last_count_ = 1;
+}
+
+void LineInfo::Flush() {
+  if (last_count_ == 0) return;
+
+  if (runs_ % CHECKPOINT_INTERVAL == 0) {
+    checkpoints_.push_back({last_offset_, (int)table_.size(), encoded_line_});
+  }
+
+  WriteVarint(table_, last_count_);
+  WriteVarint(table_, ZigZag(last_.line - encoded_line_));
+  WriteVarint(table_, last_.column);
+
+  runs_++;
+  encoded_line_ = last_.line;
+  last_offset_ += last_count_;
+  last_count_ = 0;
+}
+
+LineInfo::Position LineInfo::GetPosition(int offset) {
+  if (offset >= last_offset_) return last_;
+
+  auto checkpoint = std::upper_bound(checkpoints_.begin(), checkpoints_.end(), offset,
+                                     [](int offset, const Checkpoint& c) { return offset < c.offset; }) -
+                    1;
+
+  const uint8_t* in = table_.data() + checkpoint->index;
+  int start = checkpoint->offset;
+  int line = checkpoint->line;
+
+  for (;;) {
+    int count = ReadVarint(in);
+    line += UnZigZag(ReadVarint(in));
+    int column = ReadVarint(in);
+
+    if (offset < start + count) return {line, column};
+    start += count;
   }
-  assert(0);
 }
 
-auto Chunk::Write(uint8_t byte, int line) -> void {
+auto Chunk::Write(uint8_t byte, int line, int column) -> void {
   code.push_back(byte);
-  line_info.Append(line);
+  line_info.Append(line, column);
 }
 
 auto Chunk::WriteConstant(Value value, int line) {
@@ -66,9 +100,38 @@ auto Chunk::WriteConstant(Value value, int line) {
   }
 }
 
-auto Chunk::Disassemble(const char* name) -> void { DisassembleChunk(this, name); }
-
 auto Chunk::AddConstant(Value value) -> int {
   constants.push_back(value);
   return constants.size() - 1;
 }
+
+Function::Function(int code_size) : Object(), info(std::make_unique<FunctionInfo>()), code_size(code_size) {
+  type = ObjectType::Function;
+}
+
+Function* Function::New(int code_size) {
+  auto function = new (::operator new(sizeof(Function) + code_size)) Function(code_size);
+  std::uninitialized_value_construct_n(function->code, code_size);
+  return function;
+}
+
+void Function::Free(Function* function) {
+  function->~Function();
+  ::operator delete(function);
+}
+
+Function* FunctionBuilder::Build() {
+  auto function = Function::New(chunk.code.size());
+  function->arity = arity;
+  function->is_generator = is_generator;
+  function->upvalue_count = upvalue_count;
+  function->captured_count = captured_count;
+  function->lifted_count = lifted_count;
+  function->constants = std::move(chunk.constants);
+  function->assigns_captured = assigns_captured;
+  function->cache_count = cache_count;
+  function->info->name = name;
+  function->info->line_info = std::move(chunk.line_info);
+  std::copy(chunk.code.begin(), chunk.code.end(), function->code);
+  return function;
+}
@@ -1,37 +1,122 @@
 #pragma once
 
+#include <memory>
+#include <vector>
+
 #include "common.h"
 #include "value.h"
 
-struct LineInfo {
-  struct Line {
-    int number{};
-    int count{};
+// Maps code offsets to source positions. Runs of bytes that share a position
+// are varint encoded as (count, line delta, column), and every
+// CHECKPOINT_INTERVAL runs a checkpoint records where decoding can resume, so
+// a lookup is a binary search plus a short forward decode.
+class LineInfo {
+ public:
+  struct Position {
+    int line{};
+    int column{};
   };
 
-  std::vector<Line> lines;
+  void Append(int line, int column);
+
+  Position GetPosition(int offset);
+
+  int GetLine(int offset) { return GetPosition(offset).line; }
+
+  bool IsInSameLine(int offset1, int offset2) { return GetLine(offset1) == GetLine(offset2); }
+
+ private:
+  inline static constexpr int CHECKPOINT_INTERVAL = 16;
 
-  void Append(int line);
+  struct Checkpoint {
+    int offset{};  // first code offset of the run
+    int index{};   // where the run starts in table_
+    int line{};    // line the run's delta is relative to
+  };
+
+  void Flush();
 
-  int GetLine(int offset);
+  std::vector<uint8_t> table_;
+  std::vector<Checkpoint> checkpoints_;
+  int runs_{};
+  int encoded_line_{};
 
-  bool IsInSameLine(int offset1, int offset2);
+  // the run still being appended to is kept decoded
+  Position last_{};
+  int last_offset_{};
+  int last_count_{};
 };
 
+// The code and constants of a function while it is being compiled, copied
+// into the Function once the code is complete.
 class Chunk {
  public:
   size_t Count() { return code.size(); }
 
   std::vector<uint8_t> code;
+  std::vector<Value> constants;
+  LineInfo line_info;
+
+  auto Write(uint8_t byte, int line, int column = 0) -> void;
+  auto WriteConstant(Value value, int line);
+
+  auto AddConstant(Value value) -> int;
+};
+
+// What only errors, printing, disassembly and snapshots read.
+struct FunctionInfo {
+  String* name{};
   LineInfo line_info;
+};
+
+// Lives here rather than in value.h so it can be built from a chunk. The
+// fields a call reads come first and the code follows the object in the same
+// allocation, so a call reaches it without an extra pointer hop; only New
+// makes functions.
+struct Function : Object {
+  int arity{};
+  // calling it creates a Generator instead of running the body
+  bool is_generator{};
+  int upvalue_count{};
+  // captured variables that are never assigned, copied into each closure
+  int captured_count{};
+  // for a lifted local function, the captured values passed after the arguments
+  int lifted_count{};
   std::vector<Value> constants;
 
-  auto GetCodeBegin() { return code.begin(); }
+  // assigns a variable of an enclosing function, directly or from a nested one
+  bool assigns_captured{};
+  // property caches each of its closures keeps, one per property access site
+  int cache_count{};
+  std::unique_ptr<FunctionInfo> info;
 
-  auto Write(uint8_t byte, int line) -> void;
-  auto WriteConstant(Value value, int line);
+  int code_size{};
+  uint8_t code[];
 
-  auto Disassemble(const char* name) -> void;
+  // the code is zeroed, for the caller to fill in
+  static Function* New(int code_size);
+  static void Free(Function* function);
 
-  auto AddConstant(Value value) -> int;
+  const char* GetName() {
+    assert(info->name != nullptr);
+    return info->name->GetCString();
+  }
+
+ private:
+  explicit Function(int code_size);
+};
+
+// Function's counterpart while it is being compiled.
+struct FunctionBuilder {
+  int arity{};
+  bool is_generator{};
+  int upvalue_count{};
+  int captured_count{};
+  int lifted_count{};
+  bool assigns_captured{};
+  int cache_count{};
+  String* name{};
+  Chunk chunk;
+
+  Function* Build();
 };
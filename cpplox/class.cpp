@@ -0,0 +1,45 @@
+#include "class.h"
+
+Class::Class(String* name) : Object(), name(name) {
+  type = ObjectType::Class;
+  root.klass = this;
+}
+
+Property* Class::Lookup(Shape* shape, String* name) {
+  std::lock_guard lock(mutex_);
+
+  auto& property = shape->properties[name->hash];
+  if (property) return property.get();
+
+  property = std::make_unique<Property>();
+  property->shape = shape;
+
+  for (auto ancestor = shape; ancestor->parent != nullptr; ancestor = ancestor->parent) {
+    if (ancestor->name->hash == name->hash) {
+      property->slot = ancestor->size - 1;
+      return property.get();
+    }
+  }
+
+  if (auto iter = methods.find(name->hash); iter != methods.end()) {
+    property->method = iter->second;
+  }
+  return property.get();
+}
+
+Shape* Class::Transition(Property* property, String* name) {
+  std::lock_guard lock(mutex_);
+
+  auto shape = property->shape;
+  auto& child = shape->transitions[name->hash];
+  if (!child) {
+    child = std::make_unique<Shape>();
+    child->klass = this;
+    child->parent = shape;
+    child->name = name;
+    child->size = shape->size + 1;
+  }
+
+  property->transition.store(child.get(), std::memory_order_release);
+  return child.get();
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "value.h"
+
+struct Class;
+struct Shape;
+
+// What a property name means on instances of one shape. Made by the first
+// lookup and never changed after, so a property cache can hold it and be
+// read from any thread.
+struct Property {
+  Shape* shape{};
+  // the field's slot, -1 if instances of the shape don't have the field
+  int slot{-1};
+  // the class's method when it isn't a field, nil if there is none
+  Value method{};
+  // where an instance goes when the field is added, made by the first set
+  std::atomic<Shape*> transition{};
+};
+
+// The layout of an instance's fields. Adding a field moves an instance to a
+// child shape, so instances that get the same fields in the same order share
+// a shape and find each field at the same slot.
+struct Shape {
+  Class* klass{};
+  Shape* parent{};
+  // the field this shape adds to its parent, nullptr for the root
+  String* name{};
+  int size{};
+
+  // guarded by the class's mutex, keyed by name hash like the globals
+  std::unordered_map<size_t, std::unique_ptr<Property>> properties;
+  std::unordered_map<size_t, std::unique_ptr<Shape>> transitions;
+};
+
+struct Class : Object {
+  String* name;
+  // keyed by name hash like the globals, filled in while the class is
+  // declared and fixed from then on
+  std::unordered_map<size_t, Value> methods;
+  // the init method, nil if there is none
+  Value initializer{};
+  // the shape of a new instance, root of the class's transition tree
+  Shape root;
+
+  explicit Class(String* name);
+
+  // the property name resolves to on shape, for property cache misses
+  Property* Lookup(Shape* shape, String* name);
+
+  // the shape after adding property's field
+  Shape* Transition(Property* property, String* name);
+
+ private:
+  std::mutex mutex_;
+};
+
+// Fields are stored in the order they were added, at the slots the shape
+// gives them.
+struct Instance : Object {
+  Shape* shape;
+  std::vector<Value> fields;
+
+  explicit Instance(Class* klass) : Object(), shape(&klass->root) { type = ObjectType::Instance; }
+};
+
+struct BoundMethod : Object {
+  Value receiver;
+  Closure* method;
+
+  BoundMethod(Value receiver, Closure* method) : Object(), receiver(receiver), method(method) {
+    type = ObjectType::BoundMethod;
+  }
+};
+
+inline bool IsObjectType(Value value, ObjectType type) {
+  return std::holds_alternative<Object*>(value) && std::get<Object*>(value)->type == type;
+}
+
+inline Class* AsClass(Value value) { return reinterpret_cast<Class*>(std::get<Object*>(value)); }
+
+inline Instance* AsInstance(Value value) { return reinterpret_cast<Instance*>(std::get<Object*>(value)); }
@@ -0,0 +1,152 @@
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+
+// cpplox-client talks to a `cpplox --serve` daemon. It only depends on
+// protocol.h, so starting it costs no more than starting any small program.
+
+extern char** environ;
+
+static int Connect(const char* socket_path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path \"%s\" is too long.\n", socket_path);
+    exit(64);
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+    fprintf(stderr, "Could not connect to \"%s\": %s\n", socket_path, strerror(errno));
+    exit(74);
+  }
+  return fd;
+}
+
+// Sends one request and copies its output to our own stdout/stderr unless
+// quiet is set. Returns the script's exit code.
+static int Request(const char* socket_path, FrameKind kind, const std::string& payload, bool quiet) {
+  int conn = Connect(socket_path);
+  if (!WriteFrame(conn, kind, payload.data(), payload.size())) {
+    fprintf(stderr, "Could not send request.\n");
+    exit(74);
+  }
+
+  FrameKind reply;
+  std::vector<char> data;
+  while (ReadFrame(conn, &reply, &data)) {
+    if (reply == FrameKind::Exit && data.size() == sizeof(uint32_t)) {
+      uint32_t code;
+      memcpy(&code, data.data(), sizeof(code));
+      close(conn);
+      return code;
+    }
+
+    if (quiet) continue;
+    if (reply == FrameKind::Stdout) WriteAll(STDOUT_FILENO, data.data(), data.size());
+    if (reply == FrameKind::Stderr) WriteAll(STDERR_FILENO, data.data(), data.size());
+  }
+
+  fprintf(stderr, "Server closed the connection.\n");
+  close(conn);
+  return 70;
+}
+
+static std::string ReadStdin() {
+  std::string source;
+  char buffer[64 * 1024];
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) {
+    source.append(buffer, n);
+  }
+  return source;
+}
+
+static int SpawnAndWait(const char* binary, const char* path) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+  char* argv[] = {const_cast<char*>(binary), const_cast<char*>(path), nullptr};
+  pid_t pid;
+  int status = 0;
+  if (posix_spawn(&pid, binary, &actions, nullptr, argv, environ) == 0) waitpid(pid, &status, 0);
+
+  posix_spawn_file_actions_destroy(&actions);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 70;
+}
+
+template <typename F>
+static void Measure(const char* name, int runs, F&& run) {
+  using Clock = std::chrono::steady_clock;
+  double total = 0, best = 0;
+  for (int i = 0; i < runs; ++i) {
+    auto start = Clock::now();
+    run();
+    double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    total += ms;
+    if (i == 0 || ms < best) best = ms;
+  }
+  printf("%-8s mean %8.3f ms  min %8.3f ms\n", name, total / runs, best);
+}
+
+// cpplox-client --bench n <socket> <cpplox> <path> compares the latency of n
+// requests to the daemon with n fresh `cpplox <path>` processes
+static int Bench(int runs, const char* socket_path, const char* binary, const char* path) {
+  char resolved[PATH_MAX];
+  if (!realpath(path, resolved)) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    return 74;
+  }
+
+  Measure("server", runs, [&]() { Request(socket_path, FrameKind::RunPath, resolved, true); });
+  Measure("spawn", runs, [&]() { SpawnAndWait(binary, resolved); });
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc == 6 && strcmp(argv[1], "--bench") == 0) {
+    return Bench(std::max(1, atoi(argv[2])), argv[3], argv[4], argv[5]);
+  }
+
+  if (argc == 4 && strcmp(argv[2], "-e") == 0) {
+    return Request(argv[1], FrameKind::RunSource, argv[3], false);
+  }
+
+  if (argc == 3 && strcmp(argv[2], "-") == 0) {
+    return Request(argv[1], FrameKind::RunSource, ReadStdin(), false);
+  }
+
+  if (argc == 3) {
+    // the server resolves paths from its own working directory
+    char resolved[PATH_MAX];
+    if (!realpath(argv[2], resolved)) {
+      fprintf(stderr, "Could not open file \"%s\".\n", argv[2]);
+      return 74;
+    }
+    return Request(argv[1], FrameKind::RunPath, resolved, false);
+  }
+
+  fprintf(stderr,
+          "Usage: cpplox-client socket path\n"
+          "       cpplox-client socket -e source\n"
+          "       cpplox-client socket -\n"
+          "       cpplox-client --bench runs socket cpplox path\n");
+  return 64;
+}
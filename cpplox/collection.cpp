@@ -0,0 +1,103 @@
+#include "collection.h"
+
+#include "float64_array.h"
+#include "vm.h"
+
+namespace {
+
+List* NewList(VM* vm) {
+  auto list = new List;
+  vm->InsertObject(list);
+  return list;
+}
+
+bool CheckList(VM* vm, Value value, const char* native) {
+  if (IsList(value)) return true;
+
+  vm->RuntimeError("%s expects a list.", native);
+  return false;
+}
+
+bool CheckMap(VM* vm, Value value, const char* native) {
+  if (IsMap(value)) return true;
+
+  vm->RuntimeError("%s expects a map.", native);
+  return false;
+}
+
+Value Length(VM* vm, int argc, Value* argv) {
+  if (IsList(argv[0])) return static_cast<double>(AsList(argv[0])->values.size());
+  if (IsMap(argv[0])) return static_cast<double>(AsMap(argv[0])->table.Size());
+  if (IsFloat64Array(argv[0])) return static_cast<double>(AsFloat64Array(argv[0])->length);
+  if (IsString(argv[0])) return static_cast<double>(AsString(argv[0])->length);
+
+  vm->RuntimeError("len expects a list, map, array or string.");
+  return Nil{};
+}
+
+// appends value and returns the list
+Value Push(VM* vm, int argc, Value* argv) {
+  if (!CheckList(vm, argv[0], "push")) return Nil{};
+
+  AsList(argv[0])->values.push_back(argv[1]);
+  return argv[0];
+}
+
+Value Pop(VM* vm, int argc, Value* argv) {
+  if (!CheckList(vm, argv[0], "pop")) return Nil{};
+
+  auto& values = AsList(argv[0])->values;
+  if (values.empty()) {
+    vm->RuntimeError("Can't pop from an empty list.");
+    return Nil{};
+  }
+
+  auto value = values.back();
+  values.pop_back();
+  return value;
+}
+
+Value Has(VM* vm, int argc, Value* argv) {
+  if (!CheckMap(vm, argv[0], "has")) return Nil{};
+  return AsMap(argv[0])->table.Get(argv[1]) != nullptr;
+}
+
+// true if the key was there
+Value Remove(VM* vm, int argc, Value* argv) {
+  if (!CheckMap(vm, argv[0], "remove")) return Nil{};
+  return AsMap(argv[0])->table.Delete(argv[1]);
+}
+
+// the map's keys as a new list, in no particular order
+Value Keys(VM* vm, int argc, Value* argv) {
+  if (!CheckMap(vm, argv[0], "keys")) return Nil{};
+
+  auto& table = AsMap(argv[0])->table;
+  auto list = NewList(vm);
+  list->values.reserve(table.Size());
+  table.ForEach([list](const HashTable::Entry& entry) { list->values.push_back(entry.key); });
+  return list;
+}
+
+// the map's values as a new list, in the same order as keys
+Value Values(VM* vm, int argc, Value* argv) {
+  if (!CheckMap(vm, argv[0], "values")) return Nil{};
+
+  auto& table = AsMap(argv[0])->table;
+  auto list = NewList(vm);
+  list->values.reserve(table.Size());
+  table.ForEach([list](const HashTable::Entry& entry) { list->values.push_back(entry.value); });
+  return list;
+}
+
+}  // namespace
+
+void RegisterCollectionNatives(VM* vm) {
+  vm->DefineNativeFunction("len", &Length, 1);
+  vm->DefineNativeFunction("push", &Push, 2);
+  vm->DefineNativeFunction("pop", &Pop, 1);
+  vm->DefineNativeFunction("has", &Has, 2);
+  vm->DefineNativeFunction("remove", &Remove, 2);
+  vm->DefineNativeFunction("keys", &Keys, 1);
+  vm->DefineNativeFunction("values", &Values, 1);
+}
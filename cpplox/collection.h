@@ -0,0 +1,36 @@
+#pragma once
+
+#include <vector>
+
+#include "table.h"
+#include "value.h"
+
+// A growable array of values, [a, b, c] in source, indexed with l[i].
+struct List : Object {
+  std::vector<Value> values;
+
+  List() : Object() { type = ObjectType::List; }
+};
+
+// A hash map, {key: value, ...} in source, indexed with m[key].
+struct Map : Object {
+  HashTable table;
+
+  Map() : Object() { type = ObjectType::Map; }
+};
+
+inline bool IsList(Value value) {
+  return std::holds_alternative<Object*>(value) && std::get<Object*>(value)->type == ObjectType::List;
+}
+
+inline List* AsList(Value value) { return reinterpret_cast<List*>(std::get<Object*>(value)); }
+
+inline bool IsMap(Value value) {
+  return std::holds_alternative<Object*>(value) && std::get<Object*>(value)->type == ObjectType::Map;
+}
+
+inline Map* AsMap(Value value) { return reinterpret_cast<Map*>(std::get<Object*>(value)); }
+
+// len(collection or string), push(list, value), pop(list), has(map, key),
+// remove(map, key), keys(map) and values(map)
+void RegisterCollectionNatives(VM* vm);
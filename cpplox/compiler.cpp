@@ -2,17 +2,20 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "debug.h"
+#include "intrinsic.h"
 #include "opcode.h"
 #include "scanner.h"
 #include "value.h"
 
-std::unique_ptr<Function> Compiler::Compile() {
+Function* Compiler::Compile() {
   // TODO: ownership
   FuncScope func_scope(FunctionType::SCRIPT);
 
   func_scope.enclosing = current_;
   current_ = &func_scope;
 
+  ScanNames();
   Advance();
 
   while (!Match(TokenType::Eof)) {
@@ -21,24 +24,27 @@ std::unique_ptr<Function> Compiler::Compile() {
   Consume(TokenType::Eof, "Expect end of expression.");
 
   auto function = FinishCompile();
+  if (parser_.had_error) {
+    Function::Free(function);
+    return nullptr;
+  }
 
-  return parser_.had_error ? nullptr : std::move(function);
+  return function;
 }
 
-std::unique_ptr<Function> Compiler::FinishCompile() {
+Function* Compiler::FinishCompile() {
   EmitReturn();
 
+  auto function = current_->function->Build();
+  current_ = current_->enclosing;
+
 #ifdef DEBUG_PRINT_CODE
   printf("\n======================= compile code ===========================\n");
   if (!parser_.had_error) {
-    current_->function->chunk->Disassemble(current_->function->name != nullptr ? current_->function->GetName()
-                                                                               : "<script>");
+    DisassembleFunction(function, function->info->name != nullptr ? function->GetName() : "<script>");
   }
 #endif
 
-  auto function = std::move(current_->function);
-  current_ = current_->enclosing;
-
   return function;
 }
 
@@ -52,7 +58,11 @@ void Compiler::ParsePrecedence(Precedence precedence) {
 
   bool can_assign = precedence <= PREC_ASSIGNMENT;
   (this->*prefix_rule)(can_assign);
+  ParseInfix(precedence);
+}
 
+void Compiler::ParseInfix(Precedence precedence) {
+  bool can_assign = precedence <= PREC_ASSIGNMENT;
   while (precedence <= GetRule(parser_.current.type)->precedence) {
     Advance();
     auto infix_rule = GetRule(parser_.previous.type)->infix;
@@ -65,13 +75,9 @@ void Compiler::DeclareVariable() {
 
   Token* name = &parser_.previous;
 
-  for (int i = current_->locals.size() - 1; i >= 0; --i) {
-    auto local = &current_->locals[i];
-    if (local->depth != -1 && local->depth < current_->scope_depth_) {
-      break;
-    }
-
-    if (IdentifierEqual(name, &local->name)) {
+  if (auto iter = current_->local_slots.find(name->interned); iter != current_->local_slots.end()) {
+    auto local = &current_->locals[iter->second];
+    if (local->depth == -1 || local->depth >= current_->scope_depth_) {
       Error("Already a variable with this name in this scope.");
     }
   }
@@ -97,10 +103,11 @@ void Compiler::DefineVariable(uint8_t global) {
 }
 
 void Compiler::Number(bool can_assign) {
-  double value = strtod(parser_.previous.start, nullptr);
-  EmitConstant(value);
+  EmitConstant(parser_.previous.number);
 }
 
+void Compiler::FiberYield(bool can_assign) { NamedVariable(SyntheticToken("yield"), false); }
+
 void Compiler::Grouping(bool can_assign) {
   Expression();
   Consume(TokenType::RightParen, "Expect ')' after expression.");
@@ -203,8 +210,7 @@ void Compiler::Literal(bool can_assign) {
 }
 
 void Compiler::String(bool can_assign) {
-  EmitConstant(
-      vm_->AllocateString(std::string_view(parser_.previous.start + 1, parser_.previous.length - 2)));
+  EmitConstant(parser_.previous.interned);
 }
 
 void Compiler::Variable(bool can_assign) { NamedVariable(parser_.previous, can_assign); }
@@ -253,18 +259,144 @@ void Compiler::Call(bool can_assign) {
   EmitBytes(+OpCode::OP_CALL, arg_count);
 }
 
+void Compiler::Index(bool can_assign) {
+  Expression();
+  Consume(TokenType::RightBracket, "Expect ']' after index.");
+
+  if (can_assign && Match(TokenType::Equal)) {
+    Expression();
+    EmitByte(+OpCode::OP_INDEX_SET);
+  } else {
+    EmitByte(+OpCode::OP_INDEX_GET);
+  }
+}
+
+void Compiler::ListLiteral(bool can_assign) {
+  uint8_t count = 0;
+
+  if (!Check(TokenType::RightBracket)) {
+    do {
+      Expression();
+      if (count == 255) {
+        Error("Can't have more than 255 elements in a list literal.");
+      }
+      count++;
+    } while (Match(TokenType::Comma));
+  }
+
+  Consume(TokenType::RightBracket, "Expect ']' after list elements.");
+  EmitBytes(+OpCode::OP_LIST, count);
+}
+
+void Compiler::MapLiteral(bool can_assign) {
+  uint8_t count = 0;
+
+  if (!Check(TokenType::RightBrace)) {
+    do {
+      Expression();
+      Consume(TokenType::Colon, "Expect ':' after map key.");
+      Expression();
+      if (count == 255) {
+        Error("Can't have more than 255 entries in a map literal.");
+      }
+      count++;
+    } while (Match(TokenType::Comma));
+  }
+
+  Consume(TokenType::RightBrace, "Expect '}' after map entries.");
+  EmitBytes(+OpCode::OP_MAP, count);
+}
+
+void Compiler::Dot(bool can_assign) {
+  Consume(TokenType::Identifier, "Expect property name after '.'.");
+  auto name = IdentifierConstant(&parser_.previous);
+
+  if (can_assign && Match(TokenType::Equal)) {
+    Expression();
+    EmitBytes(+OpCode::OP_SET_PROPERTY, name);
+    EmitCacheIndex();
+  } else if (Match(TokenType::LeftParen)) {
+    // obj.method(args) calls without making a bound method
+    auto arg_count = ArgumentList();
+    EmitBytes(+OpCode::OP_INVOKE, name);
+    EmitCacheIndex();
+    EmitByte(arg_count);
+  } else {
+    EmitBytes(+OpCode::OP_GET_PROPERTY, name);
+    EmitCacheIndex();
+  }
+}
+
+void Compiler::This(bool can_assign) {
+  if (current_class_ == nullptr) {
+    Error("Can't use 'this' outside of a class.");
+    return;
+  }
+
+  NamedVariable(SyntheticToken("this"), false);
+}
+
+void Compiler::Super(bool can_assign) {
+  if (current_class_ == nullptr) {
+    Error("Can't use 'super' outside of a class.");
+  } else if (!current_class_->has_superclass) {
+    Error("Can't use 'super' in a class with no superclass.");
+  }
+
+  Consume(TokenType::Dot, "Expect '.' after 'super'.");
+  Consume(TokenType::Identifier, "Expect superclass method name.");
+  auto name = IdentifierConstant(&parser_.previous);
+
+  NamedVariable(SyntheticToken("this"), false);
+  if (Match(TokenType::LeftParen)) {
+    auto arg_count = ArgumentList();
+    NamedVariable(SyntheticToken("super"), false);
+    EmitBytes(+OpCode::OP_SUPER_INVOKE, name);
+    EmitByte(arg_count);
+  } else {
+    NamedVariable(SyntheticToken("super"), false);
+    EmitBytes(+OpCode::OP_GET_SUPER, name);
+  }
+}
+
 void Compiler::NamedVariable(Token name, bool can_assign) {
   OpCode get_op, set_op;
 
-  int arg = ResolveLocal(&name);
-  if (arg != -1) {
+  bool by_value = false;
+  int arg;
+  if (auto lifted = Check(TokenType::LeftParen) ? FindLifted(&name) : nullptr; lifted != nullptr) {
+    // a call of a lifted local function passes what it captured after the arguments
+    Advance();
+    EmitConstant(lifted->lifted);
+    int arg_count = ArgumentList();
+    for (auto& capture : lifted->lifted_captures) {
+      NamedVariable(capture.hidden, false);
+    }
+
+    arg_count += lifted->lifted_captures.size();
+    if (arg_count > UINT8_MAX) {
+      Error("Can't have more than 255 arguments.");
+    }
+    EmitBytes(+OpCode::OP_CALL, arg_count);
+    return;
+  } else if ((arg = ResolveLocal(&name)) != -1) {
     // local
     get_op = OpCode::OP_GET_LOCAL;
     set_op = OpCode::OP_SET_LOCAL;
-  } else if ((arg = ResolveUpvalue(&name)) != -1) {
-    // upvalue
-    get_op = OpCode::OP_GET_UPVALUE;
+  } else if ((arg = ResolveUpvalue(&name, &by_value)) != -1) {
+    // upvalue, or a copy of a variable that is never assigned
+    get_op = by_value ? OpCode::OP_GET_CAPTURED : OpCode::OP_GET_UPVALUE;
     set_op = OpCode::OP_SET_UPVALUE;
+  } else if (auto intrinsic = FindIntrinsic(std::string_view(name.start, name.length));
+             intrinsic != Intrinsic::Count && Check(TokenType::LeftParen)) {
+    // a call of a builtin maths function by its global name
+    Advance();
+    auto name_constant = IdentifierConstant(&name);
+    auto arg_count = ArgumentList();
+
+    EmitBytes(+OpCode::OP_INTRINSIC, +intrinsic);
+    EmitBytes(name_constant, arg_count);
+    return;
   } else {
     // global
     arg = IdentifierConstant(&name);
@@ -275,6 +407,14 @@ void Compiler::NamedVariable(Token name, bool can_assign) {
   if (can_assign && Match(TokenType::Equal)) {
     Expression();
     EmitBytes(+set_op, arg);
+
+    if (set_op == OpCode::OP_SET_UPVALUE) {
+      // every function out to the one declaring the variable writes state it captured
+      for (auto scope = current_; scope->enclosing != nullptr; scope = scope->enclosing) {
+        scope->function->assigns_captured = true;
+        if (scope->enclosing->local_slots.contains(name.interned)) break;
+      }
+    }
   } else {
     EmitBytes(+get_op, arg);
   }
@@ -314,7 +454,7 @@ void Compiler::IfStatement() {
 }
 
 void Compiler::WhileStatement() {
-  int loop_start = current_->function->chunk->Count();
+  int loop_start = current_->function->chunk.Count();
   Consume(TokenType::LeftParen, "Expect '(' after 'while'.");
   Expression();
   Consume(TokenType::RightParen, "Expect ')' after condition.");
@@ -336,6 +476,10 @@ void Compiler::ReturnStatement() {
   if (Match(TokenType::Semicolon)) {
     EmitReturn();
   } else {
+    if (current_->func_type == FunctionType::INITIALIZER) {
+      Error("Can't return a value from an initializer.");
+    }
+
     Expression();
 
     Consume(TokenType::Semicolon, "Expect ';' after return value.");
@@ -343,6 +487,40 @@ void Compiler::ReturnStatement() {
   }
 }
 
+void Compiler::YieldStatement() {
+  bool parenthesized = Match(TokenType::LeftParen);
+  if (parenthesized && Match(TokenType::RightParen)) {
+    // `yield()` calls the fiber yield native, a generator yields nil with a bare `yield;`
+    FiberYield(false);
+    EmitBytes(+OpCode::OP_CALL, 0);
+    ParseInfix(PREC_ASSIGNMENT);
+    Consume(TokenType::Semicolon, "Expect ';' after expression.");
+    EmitByte(+OpCode::OP_POP);
+    return;
+  }
+
+  if (current_->func_type == FunctionType::SCRIPT) {
+    Error("Can't yield from top-level code.");
+  }
+
+  // a function with any yield in it is a generator
+  current_->function->is_generator = true;
+
+  if (parenthesized) {
+    // the value started with a parenthesized operand
+    Grouping(false);
+    ParseInfix(PREC_ASSIGNMENT);
+    Consume(TokenType::Semicolon, "Expect ';' after yield value.");
+  } else if (Match(TokenType::Semicolon)) {
+    EmitByte(+OpCode::OP_NIL);
+  } else {
+    Expression();
+    Consume(TokenType::Semicolon, "Expect ';' after yield value.");
+  }
+
+  EmitByte(+OpCode::OP_YIELD);
+}
+
 void Compiler::ContinueStatement() {
   Consume(TokenType::Semicolon, "Expect ';' after continue statement");
   if (current_->loop_depth_ > 0) {
@@ -418,7 +596,7 @@ void Compiler::ForStatement() {
   BeginLoop();
 
   // loop condition
-  int loop_start = current_->function->chunk->Count();
+  int loop_start = current_->function->chunk.Count();
   int exit_jump = -1;
   if (!Match(TokenType::Semicolon)) {
     Expression();
@@ -432,7 +610,7 @@ void Compiler::ForStatement() {
   // loop increment
   if (!Match(TokenType::RightParen)) {
     int body_jump = EmitJump(+OpCode::OP_JUMP);
-    int increment_start = current_->function->chunk->Count();
+    int increment_start = current_->function->chunk.Count();
 
     // continue jump point
     current_->loops.back().start = increment_start;
@@ -463,14 +641,24 @@ void Compiler::ForStatement() {
 
 void Compiler::FunctionStatement(FunctionType type) {
   FuncScope new_func_scope(type);
+  auto function = FunctionBody(&new_func_scope);
+  EmitClosure(function, new_func_scope.upvalues);
+}
 
-  if (type == FunctionType::FUNCTION) {
-    new_func_scope.function->name =
-        AsString(vm_->AllocateString(std::string_view(parser_.previous.start, parser_.previous.length)));
+Function* Compiler::FunctionBody(FuncScope* scope, const Local* lifted) {
+  auto type = scope->func_type;
+  if (type != FunctionType::SCRIPT) {
+    scope->function->name = parser_.previous.interned;
   }
 
-  new_func_scope.enclosing = current_;
-  current_ = &new_func_scope;
+  scope->enclosing = current_;
+  current_ = scope;
+
+  // a method's receiver is in slot 0
+  if (type == FunctionType::METHOD || type == FunctionType::INITIALIZER) {
+    current_->locals[0].name = SyntheticToken("this");
+    current_->local_slots[current_->locals[0].name.interned] = 0;
+  }
 
   BeginScope();
 
@@ -490,19 +678,44 @@ void Compiler::FunctionStatement(FunctionType type) {
   }
 
   Consume(TokenType::RightParen, "");
+
+  if (lifted != nullptr) {
+    for (auto& capture : lifted->lifted_captures) {
+      AddLocal(capture.name);
+      MarkInitialized();
+      // calls from the body pass the values on
+      current_->local_slots[capture.hidden.interned] = current_->locals.size() - 1;
+    }
+    current_->function->lifted_count = lifted->lifted_captures.size();
+    current_->function->arity += current_->function->lifted_count;
+
+    // the body may declare names it captured
+    BeginScope();
+  }
+
   Consume(TokenType::LeftBrace, "");
   BlockStatement();
 
-  auto function = FinishCompile();
-
-  // // current function upvalue count
-  // current_->function->upvalue_count = current_->upvalues.size();
+  return FinishCompile();
+}
 
+void Compiler::EmitClosure(Function* function, const std::vector<Upvalue>& upvalues) {
   // function defination instruction (closure)
-  EmitBytes(+OpCode::OP_CLOSURE, MakeConstant(function.release()));
+  heap_->InsertObject(function);
+
+  // with nothing to capture every evaluation can share one closure, which also
+  // makes the closures from separate evaluations compare equal
+  if (upvalues.empty()) {
+    auto closure = Closure::New(function);
+    heap_->InsertObject(closure);
+    EmitConstant(closure);
+    return;
+  }
 
-  for (auto& upvalue : new_func_scope.upvalues) {
-    EmitByte(upvalue.is_local ? 1 : 0);
+  EmitBytes(+OpCode::OP_CLOSURE, MakeConstant(function));
+
+  for (auto& upvalue : upvalues) {
+    EmitByte((upvalue.is_local ? kCaptureLocal : 0) | (upvalue.by_value ? kCaptureByValue : 0));
     EmitByte(upvalue.index);
   }
 }
@@ -538,6 +751,8 @@ void Compiler::Statement() {
     // EndLoop();
   } else if (Match(TokenType::Return)) {
     ReturnStatement();
+  } else if (Match(TokenType::Yield)) {
+    YieldStatement();
   } else if (Match(TokenType::Switch)) {
     SwitchStatement();
   } else if (Match(TokenType::Continue)) {
@@ -566,12 +781,117 @@ void Compiler::VarDeclaration() {
 void Compiler::FunDeclaration() {
   uint8_t global = ParseVariable("Expect function name.");
   MarkInitialized();
+  if (current_->scope_depth_ > 0 && !referenced_.contains(parser_.previous.interned)) {
+    LocalFunction();
+    return;
+  }
   FunctionStatement(FunctionType::FUNCTION);
   DefineVariable(global);
 }
 
+// A local function that is only ever called by name can't outlive the
+// scope declaring it. When all it may capture is never assigned, it takes
+// those values as extra arguments instead, so its one closure is made at
+// compile time and calls pass copies kept in hidden locals.
+void Compiler::LocalFunction() {
+  int slot = current_->locals.size() - 1;
+
+  std::vector<Token> captures;
+  if (!ScanCaptures(slot, &captures)) {
+    FuncScope scope(FunctionType::FUNCTION);
+    auto function = FunctionBody(&scope);
+    EmitClosure(function, scope.upvalues);
+    return;
+  }
+
+  auto local = &current_->locals[slot];
+  auto name = local->name.interned->GetString();
+  for (auto& capture : captures) {
+    auto text = capture.interned->GetString();
+    // a space keeps the hidden name from clashing with any in the source
+    local->lifted_captures.push_back({SyntheticToken(text), SyntheticToken(name + " " + text)});
+  }
+
+  // made before the body so calls in it can refer to it, and given the
+  // function once that is compiled
+  auto closure = Closure::New();
+  heap_->InsertObject(closure);
+  local->lifted = closure;
+
+  FuncScope lifted_scope(FunctionType::FUNCTION);
+  auto function = FunctionBody(&lifted_scope, local);
+  closure->func = function;
+  if (function->cache_count > 0) {
+    closure->caches = std::make_unique<std::atomic<Property*>[]>(function->cache_count);
+  }
+  heap_->InsertObject(function);
+
+  EmitConstant(closure);
+  auto lifted_captures = local->lifted_captures;
+  for (auto& capture : lifted_captures) {
+    NamedVariable(capture.name, false);
+    AddLocal(capture.hidden);
+    MarkInitialized();
+  }
+}
+
+void Compiler::ClassDeclaration() {
+  Consume(TokenType::Identifier, "Expect class name.");
+  auto class_name = parser_.previous;
+  auto name_constant = IdentifierConstant(&parser_.previous);
+  DeclareVariable();
+
+  EmitBytes(+OpCode::OP_CLASS, name_constant);
+  DefineVariable(name_constant);
+
+  ClassScope class_scope{.enclosing = current_class_};
+  current_class_ = &class_scope;
+
+  if (Match(TokenType::Less)) {
+    Consume(TokenType::Identifier, "Expect superclass name.");
+    Variable(false);
+
+    if (IdentifierEqual(&class_name, &parser_.previous)) {
+      Error("A class can't inherit from itself.");
+    }
+
+    // methods capture the superclass as a local named super
+    BeginScope();
+    AddLocal(SyntheticToken("super"));
+    DefineVariable(0);
+
+    NamedVariable(class_name, false);
+    EmitByte(+OpCode::OP_INHERIT);
+    class_scope.has_superclass = true;
+  }
+
+  NamedVariable(class_name, false);
+  Consume(TokenType::LeftBrace, "Expect '{' before class body.");
+  while (!Check(TokenType::RightBrace) && !Check(TokenType::Eof)) {
+    Method();
+  }
+  Consume(TokenType::RightBrace, "Expect '}' after class body.");
+  EmitByte(+OpCode::OP_POP);
+
+  if (class_scope.has_superclass) EndScope();
+
+  current_class_ = class_scope.enclosing;
+}
+
+void Compiler::Method() {
+  Consume(TokenType::Identifier, "Expect method name.");
+  auto constant = IdentifierConstant(&parser_.previous);
+
+  auto name = std::string_view(parser_.previous.start, parser_.previous.length);
+  auto type = name == "init" ? FunctionType::INITIALIZER : FunctionType::METHOD;
+  FunctionStatement(type);
+  EmitBytes(+OpCode::OP_METHOD, constant);
+}
+
 void Compiler::Declaration() {
-  if (Match(TokenType::Var)) {
+  if (Match(TokenType::Class)) {
+    ClassDeclaration();
+  } else if (Match(TokenType::Var)) {
     VarDeclaration();
   } else if (Match(TokenType::Fun)) {
     FunDeclaration();
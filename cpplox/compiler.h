@@ -1,21 +1,39 @@
 #pragma once
 
+#include <unordered_map>
+#include <unordered_set>
+
 #include "chunk.h"
+#include "heap.h"
 #include "object.h"
 #include "scanner.h"
-#include "vm.h"
 
 class Compiler {
  public:
-  Compiler(const char* source, VM* vm) : vm_(vm), source_(source), scanner_(source) {}
+  Compiler(std::string_view source, Heap* heap, int line = 1)
+      : heap_(heap), source_(source), scanner_(source, heap, line) {}
 
-  std::unique_ptr<Function> Compile();
+  // the script function, owned by the caller; nullptr on a compile error
+  Function* Compile();
 
  private:
+  // a variable a lifted function captured, and the hidden local of the
+  // declaring scope that keeps its value for calls
+  struct LiftedCapture {
+    Token name;
+    Token hidden;
+  };
+
   struct Local {
     Token name;
     int depth{};
     bool is_captured{};
+    // slot of the outer local with the same name, -1 if none
+    int shadowed{-1};
+    // for a local function that takes what it captured as extra arguments,
+    // the one closure every call uses
+    ::Closure* lifted{};
+    std::vector<LiftedCapture> lifted_captures;
   };
 
   struct Parser {
@@ -27,6 +45,8 @@ class Compiler {
 
   enum class FunctionType {
     FUNCTION,
+    INITIALIZER,
+    METHOD,
     SCRIPT,
   };
 
@@ -61,15 +81,20 @@ class Compiler {
   };
 
   struct Upvalue {
+    ::String* name;
     uint8_t index;
     bool is_local;
+    // copied when the closure is made, the variable is never assigned
+    bool by_value;
   };
 
+  inline static constexpr int LOCALS_MAX = UINT8_MAX + 1;
+
   struct FuncScope {
     // ref
     FuncScope* enclosing{};
 
-    std::unique_ptr<Function> function{};
+    std::unique_ptr<FunctionBuilder> function{};
 
     FunctionType func_type;
 
@@ -80,7 +105,12 @@ class Compiler {
     std::vector<Loop> loops;
     std::vector<Upvalue> upvalues;
 
-    FuncScope(FunctionType type) : function(std::make_unique<Function>()), func_type(type) {
+    // innermost visible slot for each interned name
+    std::unordered_map<::String*, int> local_slots;
+    // (by_value << 9 | is_local << 8 | index) -> index in the closure
+    std::unordered_map<uint16_t, int> upvalue_slots;
+
+    FuncScope(FunctionType type) : function(std::make_unique<FunctionBuilder>()), func_type(type) {
       Local local;
       local.name.start = "";
       local.name.length = 0;
@@ -92,18 +122,30 @@ class Compiler {
     ~FuncScope() { enclosing = nullptr; }
   };
 
-  VM* vm_;
+  struct ClassScope {
+    ClassScope* enclosing{};
+    bool has_superclass{};
+  };
+
+  Heap* heap_;
+
+  FuncScope* current_{};
 
-  FuncScope* current_;
+  ClassScope* current_class_{};
 
   static const ParseRule rules[];
 
-  const char* source_;
+  std::string_view source_;
 
   Scanner scanner_;
 
   Parser parser_;
 
+  // names assigned anywhere in the source, after their declaration
+  std::unordered_set<::String*> assigned_;
+  // names used anywhere other than as the callee of a call
+  std::unordered_set<::String*> referenced_;
+
   static const ParseRule* GetRule(TokenType type);
 
   void ErrorAtCurrent(const char* message) { ErrorAt(&parser_.current, message); }
@@ -117,7 +159,14 @@ class Compiler {
 
   void Consume(TokenType type, const char* message);
 
-  std::unique_ptr<Function> FinishCompile();
+  Function* FinishCompile();
+
+  // fills assigned_ and referenced_ from a scan of the whole source
+  void ScanNames();
+
+  // the variables a local function declared in slot may capture, from a scan
+  // of its parameters and body; false if it can't take them as arguments
+  bool ScanCaptures(int slot, std::vector<Token>* captures);
 
   void Advance();
 
@@ -153,6 +202,9 @@ class Compiler {
 
   void ParsePrecedence(Precedence precedence);
 
+  // the infix operators after an operand that was already compiled
+  void ParseInfix(Precedence precedence);
+
   void AddLocal(Token name);
 
   void DeclareVariable();
@@ -165,9 +217,9 @@ class Compiler {
 
   int ResolveLocal(Token* name);
 
-  int AddUpvalue(uint8_t index, bool is_local);
+  int AddUpvalue(::String* name, uint8_t index, bool is_local, bool by_value);
 
-  int ResolveUpvalue(Token* name);
+  int ResolveUpvalue(Token* name, bool* by_value);
 
   void Synchronize();
 
@@ -183,6 +235,27 @@ class Compiler {
   void Call(bool can_assign);
   uint8_t ArgumentList();
 
+  void Dot(bool can_assign);
+
+  void This(bool can_assign);
+
+  void Super(bool can_assign);
+
+  // a name the compiler refers to without it being in the source
+  Token SyntheticToken(std::string_view text);
+
+  // the local function name calls, if it was lifted
+  Local* FindLifted(Token* name);
+
+  // reserves a property cache slot in the current function
+  void EmitCacheIndex();
+
+  void Index(bool can_assign);
+
+  // [a, b] and {key: value}
+  void ListLiteral(bool can_assign);
+  void MapLiteral(bool can_assign);
+
   void Grouping(bool can_assign);
 
   void Unary(bool can_assign);
@@ -195,6 +268,9 @@ class Compiler {
 
   void Ternary(bool can_assign);
 
+  // `yield` used as a value is the fiber yield native
+  void FiberYield(bool can_assign);
+
   void Expression();
 
   void PrintStatement();
@@ -207,6 +283,8 @@ class Compiler {
 
   void ReturnStatement();
 
+  void YieldStatement();
+
   void ContinueStatement();
 
   void BreakStatement();
@@ -217,6 +295,12 @@ class Compiler {
 
   void FunctionStatement(FunctionType type);
 
+  // parameters and body, after the name; a lifted function's captured
+  // variables are declared after its parameters
+  Function* FunctionBody(FuncScope* scope, const Local* lifted = nullptr);
+
+  void EmitClosure(Function* function, const std::vector<Upvalue>& upvalues);
+
   void ExpressionStatement();
 
   void Statement();
@@ -225,5 +309,11 @@ class Compiler {
 
   void FunDeclaration();
 
+  void LocalFunction();
+
+  void ClassDeclaration();
+
+  void Method();
+
   void Declaration();
 };
@@ -1,4 +1,5 @@
 
+#include <cstring>
 #include <functional>
 #include <ranges>
 
@@ -22,6 +23,99 @@ void Compiler::Advance() {
   }
 }
 
+void Compiler::ScanNames() {
+  Scanner scanner(source_, heap_);
+
+  // property names after a dot aren't variables
+  Token before{}, previous{};
+  for (auto token = scanner.ScanToken(); token.type != TokenType::Eof; token = scanner.ScanToken()) {
+    if (previous.type == TokenType::Identifier && before.type != TokenType::Dot) {
+      // name = value, but not var name = value
+      if (token.type == TokenType::Equal && before.type != TokenType::Var) assigned_.insert(previous.interned);
+      if (token.type != TokenType::LeftParen) referenced_.insert(previous.interned);
+    }
+    before = previous;
+    previous = token;
+  }
+}
+
+// Every name in the body is looked up as the body's first line would see it,
+// so a name the body declares for itself may be listed too, and only passes a
+// value nothing reads. A function that yields, or that uses a variable which is
+// assigned somewhere, isn't lifted.
+bool Compiler::ScanCaptures(int slot, std::vector<Token>* captures) {
+  auto self = current_->locals[slot].name.interned;
+  std::unordered_set<::String*> params;
+  std::unordered_set<::String*> seen;
+
+  auto capture = [&](const Token& name) {
+    if (name.interned == self || params.contains(name.interned)) return true;
+    if (!seen.insert(name.interned).second) return true;
+
+    for (auto scope = current_; scope != nullptr; scope = scope->enclosing) {
+      auto iter = scope->local_slots.find(name.interned);
+      if (iter == scope->local_slots.end()) continue;
+
+      // calls of a lifted function pass what it captured instead of the function
+      auto& local = scope->locals[iter->second];
+      if (local.lifted != nullptr) {
+        for (auto& lifted : local.lifted_captures) {
+          if (seen.insert(lifted.hidden.interned).second) captures->push_back(lifted.hidden);
+        }
+        return true;
+      }
+
+      if (assigned_.contains(name.interned)) return false;
+      captures->push_back(name);
+      return true;
+    }
+
+    // a global
+    return true;
+  };
+
+  // the current token is the parameter list's '('
+  Scanner scanner = scanner_;
+  auto token = scanner.ScanToken();
+  for (; token.type != TokenType::RightParen && token.type != TokenType::Eof; token = scanner.ScanToken()) {
+    if (token.type == TokenType::Identifier) params.insert(token.interned);
+  }
+
+  int depth = 0;
+  Token previous = token;
+  for (token = scanner.ScanToken(); token.type != TokenType::Eof; token = scanner.ScanToken()) {
+    bool captured = true;
+    switch (token.type) {
+      case TokenType::LeftBrace:
+        depth++;
+        break;
+      case TokenType::RightBrace:
+        depth--;
+        break;
+      case TokenType::Yield:
+        return false;
+      case TokenType::This:
+        captured = capture(SyntheticToken("this"));
+        break;
+      case TokenType::Super:
+        captured = capture(SyntheticToken("super"));
+        break;
+      case TokenType::Identifier:
+        // property names after a dot aren't variables
+        if (previous.type != TokenType::Dot) captured = capture(token);
+        break;
+      default:
+        break;
+    }
+
+    if (!captured) return false;
+    if (depth == 0) break;
+    previous = token;
+  }
+
+  return params.size() + captures->size() <= UINT8_MAX;
+}
+
 bool Compiler::Match(TokenType type) {
   if (!Check(type)) return false;
   Advance();
@@ -55,7 +149,9 @@ void Compiler::Consume(TokenType type, const char* message) {
   ErrorAtCurrent(message);
 }
 
-void Compiler::EmitByte(uint8_t byte) { current_->function->chunk->Write(byte, parser_.previous.line); }
+void Compiler::EmitByte(uint8_t byte) {
+  current_->function->chunk.Write(byte, parser_.previous.line, parser_.previous.column);
+}
 
 void Compiler::EmitBytes(uint8_t byte1, uint8_t byte2) {
   EmitByte(byte1);
@@ -63,14 +159,19 @@ void Compiler::EmitBytes(uint8_t byte1, uint8_t byte2) {
 }
 
 void Compiler::EmitReturn() {
-  EmitByte(+OpCode::OP_NIL);
+  if (current_->func_type == FunctionType::INITIALIZER) {
+    // init returns the instance
+    EmitBytes(+OpCode::OP_GET_LOCAL, 0);
+  } else {
+    EmitByte(+OpCode::OP_NIL);
+  }
   EmitByte(+OpCode::OP_RETURN);
 }
 
 void Compiler::EmitConstant(Value value) { EmitBytes(+OpCode::OP_CONSTANT, MakeConstant(value)); }
 
 uint8_t Compiler::MakeConstant(Value value) {
-  int constant = current_->function->chunk->AddConstant(value);
+  int constant = current_->function->chunk.AddConstant(value);
   if (constant > UINT8_MAX) {
     // TODO: OP_CONSTANT_LONG
     Error("Too may constants in one chunk.");
@@ -85,39 +186,39 @@ uint16_t Compiler::EmitJump(uint8_t instruction) {
   // jump offset 16byte
   EmitBytes(0xff, 0xff);
 
-  return current_->function->chunk->Count() - 2;
+  return current_->function->chunk.Count() - 2;
 }
 
 uint16_t Compiler::EmitLoop(int loop_start) {
   EmitByte(+OpCode::OP_LOOP);
 
-  int offset = current_->function->chunk->Count() - loop_start + 2;
+  int offset = current_->function->chunk.Count() - loop_start + 2;
   if (offset > UINT16_MAX) Error("Loop body too large.");
 
   EmitByte((offset >> 8) & 0xff);
   EmitByte(offset & 0xff);
 
-  return current_->function->chunk->Count() - 2;
+  return current_->function->chunk.Count() - 2;
 }
 
 void Compiler::PatchJump(int offset) {
-  int jump = current_->function->chunk->Count() - offset - 2;
+  int jump = current_->function->chunk.Count() - offset - 2;
   if (jump > UINT16_MAX) {
     Error("Too much code to jump over.");
   }
 
-  current_->function->chunk->code[offset] = (jump >> 8) & 0xff;
-  current_->function->chunk->code[offset + 1] = jump & 0xff;
+  current_->function->chunk.code[offset] = (jump >> 8) & 0xff;
+  current_->function->chunk.code[offset + 1] = jump & 0xff;
 }
 
 void Compiler::PatchJumpWithOffset(int offset, uint16_t dest) {
-  // int jump = current_->function->chunk->Count() - offset - 2;
+  // int jump = current_->function->chunk.Count() - offset - 2;
   if (dest > UINT16_MAX) {
     Error("Too much code to jump over.");
   }
 
-  current_->function->chunk->code[offset] = (dest >> 8) & 0xff;
-  current_->function->chunk->code[offset + 1] = dest & 0xff;
+  current_->function->chunk.code[offset] = (dest >> 8) & 0xff;
+  current_->function->chunk.code[offset + 1] = dest & 0xff;
 }
 
 void Compiler::BeginScope() { current_->scope_depth_++; }
@@ -127,23 +228,30 @@ void Compiler::EndScope() {
 
   while (current_->locals.size() > 0 && current_->locals.back().depth > current_->scope_depth_) {
 
-    if (current_->locals.back().is_captured) {
+    auto& local = current_->locals.back();
+    if (local.is_captured) {
       EmitByte(+OpCode::OP_CLOSE_UPVALUE);
     } else {
       EmitByte(+OpCode::OP_POP);
     }
+
+    if (local.shadowed == -1) {
+      current_->local_slots.erase(local.name.interned);
+    } else {
+      current_->local_slots[local.name.interned] = local.shadowed;
+    }
     current_->locals.pop_back();
   }
 }
 
 void Compiler::BeginLoop() {
-  current_->loops.push_back(Loop{.start = (int)current_->function->chunk->Count()});
+  current_->loops.push_back(Loop{.start = (int)current_->function->chunk.Count()});
   current_->loop_depth_++;
 }
 
 void Compiler::EndLoop() {
   current_->loop_depth_--;
-  current_->loops.back().stop = (int)current_->function->chunk->Count();
+  current_->loops.back().stop = (int)current_->function->chunk.Count();
 
   // patch break
   for (auto b : current_->loops.back().breaks) {
@@ -160,58 +268,89 @@ void Compiler::EndLoop() {
 }
 
 void Compiler::AddLocal(Token name) {
-  if (current_->locals.size() == current_->locals.max_size()) {
+  if (current_->locals.size() == LOCALS_MAX) {
     Error("Too many local variables in function.");
     return;
   }
 
-  current_->locals.push_back(Local{.name = name, .depth = -1, .is_captured = false});
+  int slot = current_->locals.size();
+  int shadowed = -1;
+
+  auto [iter, inserted] = current_->local_slots.try_emplace(name.interned, slot);
+  if (!inserted) {
+    shadowed = iter->second;
+    iter->second = slot;
+  }
+
+  current_->locals.push_back(Local{.name = name, .depth = -1, .is_captured = false, .shadowed = shadowed});
 }
 
-uint8_t Compiler::IdentifierConstant(Token* name) {
-  return MakeConstant(vm_->AllocateString(std::string_view(name->start, name->length)));
+uint8_t Compiler::IdentifierConstant(Token* name) { return MakeConstant(name->interned); }
+
+Token Compiler::SyntheticToken(std::string_view text) {
+  Token token;
+  token.type = TokenType::Identifier;
+  token.interned = AsString(heap_->AllocateString(text));
+  token.start = token.interned->content;
+  token.length = token.interned->length;
+  token.line = parser_.previous.line;
+  token.column = parser_.previous.column;
+  return token;
 }
 
-bool Compiler::IdentifierEqual(Token* a, Token* b) {
-  if (a->length != b->length) return false;
-  return memcmp(a->start, b->start, a->length) == 0;
+Compiler::Local* Compiler::FindLifted(Token* name) {
+  for (auto scope = current_; scope != nullptr; scope = scope->enclosing) {
+    if (auto iter = scope->local_slots.find(name->interned); iter != scope->local_slots.end()) {
+      auto local = &scope->locals[iter->second];
+      return local->lifted != nullptr ? local : nullptr;
+    }
+  }
+  return nullptr;
 }
 
+void Compiler::EmitCacheIndex() {
+  auto index = current_->function->cache_count++;
+  if (index > UINT16_MAX) {
+    Error("Too many property accesses in one function.");
+  }
+
+  EmitBytes((index >> 8) & 0xff, index & 0xff);
+}
+
+bool Compiler::IdentifierEqual(Token* a, Token* b) { return a->interned == b->interned; }
+
 int Compiler::ResolveLocal(Token* name) {
-  for (int i = current_->locals.size() - 1; i >= 0; i--) {
-    auto local = &current_->locals[i];
-    if (IdentifierEqual(name, &local->name)) {
-      if (local->depth == -1) {
-        Error("Can't read local variable in its own initializer.");
-      }
-      return i;
-    }
+  auto iter = current_->local_slots.find(name->interned);
+  if (iter == current_->local_slots.end()) return -1;
+
+  if (current_->locals[iter->second].depth == -1) {
+    Error("Can't read local variable in its own initializer.");
   }
 
-  return -1;
+  return iter->second;
 }
 
-int Compiler::AddUpvalue(uint8_t index, bool is_local) {
-  for (auto& upvalue : current_->upvalues) {
-    if (index == upvalue.index && is_local == upvalue.is_local) {
-      return index;
-    }
+int Compiler::AddUpvalue(::String* name, uint8_t index, bool is_local, bool by_value) {
+  uint16_t key = (by_value ? 1 << 9 : 0) | (is_local ? 1 << 8 : 0) | index;
+  auto function = current_->function.get();
+  auto [iter, inserted] =
+      current_->upvalue_slots.try_emplace(key, by_value ? function->captured_count : function->upvalue_count);
+  if (!inserted) {
+    return iter->second;
   }
 
-  current_->upvalues.push_back({index, is_local});
+  current_->upvalues.push_back({name, index, is_local, by_value});
 
   if (current_->upvalues.size() >= 255) {
     Error("Too many closure variable in function");
     return 0;
   }
 
-  current_->function->upvalue_count = current_->upvalues.size();
-
-  // index
-  return current_->upvalues.size() - 1;
+  // captured values and upvalues are indexed separately
+  return by_value ? function->captured_count++ : function->upvalue_count++;
 }
 
-int Compiler::ResolveUpvalue(Token* name) {
+int Compiler::ResolveUpvalue(Token* name, bool* by_value) {
   if (current_->enclosing == nullptr) return -1;
 
   auto temp = current_;
@@ -220,17 +359,20 @@ int Compiler::ResolveUpvalue(Token* name) {
 
   int index = ResolveLocal(name);
   if (index != -1) {
-    current_->locals[index].is_captured = true;
+    // a local that is never assigned already has its final value when any
+    // closure can capture it, so closures copy it and it needn't be closed
+    *by_value = !assigned_.contains(name->interned);
+    if (!*by_value) current_->locals[index].is_captured = true;
 
     current_ = temp;
-    int idx = AddUpvalue(index, true);
+    int idx = AddUpvalue(name->interned, index, true, *by_value);
     return idx;
   }
 
-  index = ResolveUpvalue(name);
+  index = ResolveUpvalue(name, by_value);
   if (index != -1) {
     current_ = temp;
-    int idx = AddUpvalue(index, false);
+    int idx = AddUpvalue(name->interned, index, false, *by_value);
     return idx;
   }
 
@@ -7,24 +7,24 @@
 #include "opcode.h"
 #include "value.h"
 
-void DisassembleChunk(Chunk *chunk, const char *name) {
+void DisassembleFunction(Function *function, const char *name) {
   printf("== %s ==\n", name);
 
-  for (int offset = 0; offset < chunk->Count();) {
-    offset = disassembleInstruction(chunk, offset);
+  for (int offset = 0; offset < function->code_size;) {
+    offset = disassembleInstruction(function, offset);
   }
 }
 
-static int ConstantInstruction(const char *name, Chunk *chunk, int offset) {
-  uint8_t constant = chunk->code[offset + 1];
+static int ConstantInstruction(const char *name, Function *function, int offset) {
+  uint8_t constant = function->code[offset + 1];
   printf("%-16s %4d '", name, constant);
-  PrintValue(chunk->constants[constant]);
+  PrintValue(function->constants[constant]);
   printf("'\n");
 
   return offset + 2;
 }
 
-static int LongConstantInstruction(const char *name, Chunk *chunk, int offset) {
+static int LongConstantInstruction(const char *name, Function *function, int offset) {
   struct LongConstant {
     uint8_t instruct;
     int operand : 24;
@@ -32,10 +32,10 @@ static int LongConstantInstruction(const char *name, Chunk *chunk, int offset) {
 
   static_assert(sizeof(LongConstant) == 4, "LongConstant size not equal 4");
 
-  LongConstant *instruct = (LongConstant *)(chunk->code.data() + offset);
+  LongConstant *instruct = (LongConstant *)(function->code + offset);
 
   printf("%-16s %4d '", name, instruct->operand);
-  PrintValue(chunk->constants[instruct->operand]);
+  PrintValue(function->constants[instruct->operand]);
   printf("'\n");
 
   return offset + 4;
@@ -46,29 +46,43 @@ static int SimpleInstruction(const char *name, int offset) {
   return offset + 1;
 }
 
-static int ByteInstruction(const char *name, Chunk *chunk, int offset) {
-  auto slot = chunk->code[offset + 1];
+static int ByteInstruction(const char *name, Function *function, int offset) {
+  auto slot = function->code[offset + 1];
   printf("%-16s %4d\n", name, slot);
   return offset + 2;
 }
 
-static int JumpInstruction(const char *name, int sign, Chunk *chunk, int offset) {
-  uint16_t jump = (chunk->code[offset + 1] << 8);
-  jump |= chunk->code[offset + 2];
+// name constant, property cache index and, for OP_INVOKE, argument count
+static int PropertyInstruction(const char *name, Function *function, int offset, bool has_args) {
+  uint8_t constant = function->code[offset + 1];
+  int cache = (function->code[offset + 2] << 8) | function->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  PrintValue(function->constants[constant]);
+  printf("' cache %d", cache);
+  if (has_args) printf(" (%d args)", function->code[offset + 4]);
+  printf("\n");
+
+  return offset + (has_args ? 5 : 4);
+}
+
+static int JumpInstruction(const char *name, int sign, Function *function, int offset) {
+  uint16_t jump = (function->code[offset + 1] << 8);
+  jump |= function->code[offset + 2];
 
   printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
   return offset + 3;
 }
 
-int disassembleInstruction(Chunk *chunk, int offset) {
+int disassembleInstruction(Function *function, int offset) {
   printf("Instruction: %04d ", offset);
-  if (offset > 0 && chunk->line_info.IsInSameLine(offset, offset - 1)) {
-    printf("   | ");
+  auto position = function->info->line_info.GetPosition(offset);
+  if (offset > 0 && function->info->line_info.GetLine(offset - 1) == position.line) {
+    printf("   |     ");
   } else {
-    printf("%4d ", chunk->line_info.GetLine(offset));
+    printf("%4d:%-3d ", position.line, position.column);
   }
 
-  uint8_t instruction = chunk->code[offset];
+  uint8_t instruction = function->code[offset];
 
   using enum OpCode;
   switch (instruction) {
@@ -76,7 +90,7 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return SimpleInstruction("OP_RETURN", offset);
 
     case +OP_CONSTANT:
-      return ConstantInstruction("OP_CONSTANT", chunk, offset);
+      return ConstantInstruction("OP_CONSTANT", function, offset);
 
     case +OP_FALSE:
       return SimpleInstruction("OP_FALSE", offset);
@@ -88,7 +102,7 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return SimpleInstruction("OP_NIL", offset);
 
     case +OP_CONSTANT_LONG:
-      return LongConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
+      return LongConstantInstruction("OP_CONSTANT_LONG", function, offset);
 
     case +OP_ADD:
       return SimpleInstruction("OP_ADD", offset);
@@ -127,57 +141,61 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return SimpleInstruction("OP_COMPARE", offset);
 
     case +OP_DEFINE_GLOBAL:
-      return ConstantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+      return ConstantInstruction("OP_DEFINE_GLOBAL", function, offset);
 
     case +OP_GET_GLOBAL:
-      return ConstantInstruction("OP_GET_GLOBAL", chunk, offset);
+      return ConstantInstruction("OP_GET_GLOBAL", function, offset);
 
     case +OP_SET_GLOBAL:
-      return ConstantInstruction("OP_SET_GLOBAL", chunk, offset);
+      return ConstantInstruction("OP_SET_GLOBAL", function, offset);
 
     case +OP_GET_LOCAL:
-      return ByteInstruction("OP_GET_LOCAL", chunk, offset);
+      return ByteInstruction("OP_GET_LOCAL", function, offset);
 
     case +OP_SET_LOCAL:
-      return ByteInstruction("OP_SET_LOCAL", chunk, offset);
+      return ByteInstruction("OP_SET_LOCAL", function, offset);
 
     case +OP_GET_UPVALUE:
-      return ByteInstruction("OP_GET_UPVALUE", chunk, offset);
+      return ByteInstruction("OP_GET_UPVALUE", function, offset);
 
     case +OP_SET_UPVALUE:
-      return ByteInstruction("OP_SET_UPVALUE", chunk, offset);
+      return ByteInstruction("OP_SET_UPVALUE", function, offset);
+
+    case +OP_GET_CAPTURED:
+      return ByteInstruction("OP_GET_CAPTURED", function, offset);
 
     case +OP_JUMP:
-      return JumpInstruction("OP_JUMP", 1, chunk, offset);
+      return JumpInstruction("OP_JUMP", 1, function, offset);
 
     case +OP_JUMP_IF_FALSE:
-      return JumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+      return JumpInstruction("OP_JUMP_IF_FALSE", 1, function, offset);
 
     case +OP_JUMP_IF_NO_EQUAL:
-      return JumpInstruction("OP_JUMP_IF_NO_EQUAL", 1, chunk, offset);
+      return JumpInstruction("OP_JUMP_IF_NO_EQUAL", 1, function, offset);
 
     case +OP_LOOP:
-      return JumpInstruction("OP_LOOP", -1, chunk, offset);
+      return JumpInstruction("OP_LOOP", -1, function, offset);
 
     case +OP_CALL:
-      return ByteInstruction("OP_CALL", chunk, offset);
+      return ByteInstruction("OP_CALL", function, offset);
 
     case +OP_CLOSURE: {
       offset++;
-      uint8_t constant = chunk->code[offset++];
+      uint8_t constant = function->code[offset++];
       printf("%-16s %4d ", "OP_CLOSURE", constant);
-      PrintValue(chunk->constants[constant]);
+      PrintValue(function->constants[constant]);
       printf("\n");
 
 
-      Function* function = reinterpret_cast<Function*>(std::get<Object*>(chunk->constants[constant]));
+      Function* function = reinterpret_cast<Function*>(std::get<Object*>(function->constants[constant]));
 
-      for (int i = 0; i < function->upvalue_count; ++i) {
-        int is_local = chunk->code[offset++];
-        int index = chunk->code[offset++];
+      for (int i = 0; i < function->upvalue_count + function->captured_count; ++i) {
+        int kind = function->code[offset++];
+        int index = function->code[offset++];
 
-        printf("%012d    |                        %s %d\n", 
-               offset - 2, is_local ? "local" : "upvalue", index);
+        printf("%012d    |                        %s%s %d\n", offset - 2,
+               (kind & kCaptureLocal) ? "local" : (kind & kCaptureByValue) ? "captured" : "upvalue",
+               (kind & kCaptureLocal) && (kind & kCaptureByValue) ? " copy" : "", index);
       }
 
       return offset;
@@ -186,6 +204,58 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     case +OP_CLOSE_UPVALUE:
       return SimpleInstruction("OP_CLOSE_UPVALUE", offset);
 
+    case +OP_YIELD:
+      return SimpleInstruction("OP_YIELD", offset);
+
+    case +OP_INDEX_GET:
+      return SimpleInstruction("OP_INDEX_GET", offset);
+
+    case +OP_INDEX_SET:
+      return SimpleInstruction("OP_INDEX_SET", offset);
+
+    case +OP_LIST:
+      return ByteInstruction("OP_LIST", function, offset);
+
+    case +OP_MAP:
+      return ByteInstruction("OP_MAP", function, offset);
+
+    case +OP_CLASS:
+      return ConstantInstruction("OP_CLASS", function, offset);
+
+    case +OP_INHERIT:
+      return SimpleInstruction("OP_INHERIT", offset);
+
+    case +OP_METHOD:
+      return ConstantInstruction("OP_METHOD", function, offset);
+
+    case +OP_GET_PROPERTY:
+      return PropertyInstruction("OP_GET_PROPERTY", function, offset, false);
+
+    case +OP_SET_PROPERTY:
+      return PropertyInstruction("OP_SET_PROPERTY", function, offset, false);
+
+    case +OP_INVOKE:
+      return PropertyInstruction("OP_INVOKE", function, offset, true);
+
+    case +OP_GET_SUPER:
+      return ConstantInstruction("OP_GET_SUPER", function, offset);
+
+    case +OP_SUPER_INVOKE: {
+      uint8_t constant = function->code[offset + 1];
+      printf("%-16s %4d '", "OP_SUPER_INVOKE", constant);
+      PrintValue(function->constants[constant]);
+      printf("' (%d args)\n", function->code[offset + 2]);
+      return offset + 3;
+    }
+
+    case +OP_INTRINSIC: {
+      uint8_t constant = function->code[offset + 2];
+      printf("%-16s %4d '", "OP_INTRINSIC", function->code[offset + 1]);
+      PrintValue(function->constants[constant]);
+      printf("' (%d args)\n", function->code[offset + 3]);
+      return offset + 4;
+    }
+
     default:
       printf("Unknow opcode %d\n", instruction);
       return offset + 1;
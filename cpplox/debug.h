@@ -2,5 +2,5 @@
 
 #include "chunk.h"
 
-void DisassembleChunk(Chunk* chunk, const char* name);
-int disassembleInstruction(Chunk* chunk, int offset);
+void DisassembleFunction(Function* function, const char* name);
+int disassembleInstruction(Function* function, int offset);
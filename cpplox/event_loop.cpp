@@ -0,0 +1,445 @@
+#include "event_loop.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include "fiber.h"
+#include "scheduler.h"
+#include "vm.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+Value IoRequest::ToValue(VM* vm) {
+  if (result < 0) return Nil{};
+
+  switch (kind) {
+    case Kind::Sleep:
+      return Nil{};
+    case Kind::Read:
+    case Kind::ReadFile:
+      return vm->AllocateString(data);
+    case Kind::Write:
+    case Kind::Accept:
+      return static_cast<double>(result);
+  }
+  return Nil{};
+}
+
+static void SetNonBlocking(int fd) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); }
+
+static void ReadFile(IoRequest* request) {
+  int fd = open(request->data.c_str(), O_RDONLY | O_CLOEXEC);
+  request->data.clear();
+  if (fd == -1) {
+    request->result = -1;
+    return;
+  }
+
+  char buffer[64 * 1024];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+    request->data.append(buffer, n);
+  }
+  request->result = n < 0 ? -1 : request->data.size();
+
+  close(fd);
+}
+
+// Makes what progress it can on a descriptor operation, false if it has to
+// wait for the descriptor again.
+static bool Perform(IoRequest* request) {
+  switch (request->kind) {
+    case IoRequest::Kind::Read: {
+      request->data.resize(request->size);
+      ssize_t n = read(request->fd, request->data.data(), request->size);
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) return false;
+
+      request->result = n;
+      request->data.resize(n < 0 ? 0 : n);
+      return true;
+    }
+
+    case IoRequest::Kind::Write: {
+      ssize_t n = write(request->fd, request->data.data() + request->size, request->data.size() - request->size);
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) return false;
+      if (n < 0) {
+        request->result = -1;
+        return true;
+      }
+
+      request->size += n;
+      request->result = request->size;
+      return request->size == request->data.size();
+    }
+
+    case IoRequest::Kind::Accept: {
+      int fd = accept(request->fd, nullptr, nullptr);
+      if (fd < 0 && (errno == EAGAIN || errno == EINTR)) return false;
+      if (fd >= 0) SetNonBlocking(fd);
+
+      request->result = fd;
+      return true;
+    }
+
+    default:
+      return true;
+  }
+}
+
+void EventLoop::Complete(IoRequest* request) {
+  if (request->fiber != nullptr) {
+    owner_->GetScheduler()->Wake(request->fiber);
+    return;
+  }
+
+  // notified under the lock, the waiter frees the request once it wakes
+  std::lock_guard guard(request->lock);
+  request->done = true;
+  request->completed.notify_one();
+}
+
+void EventLoop::Wait(IoRequest* request) {
+  Submit(request);
+
+  std::unique_lock guard(request->lock);
+  request->completed.wait(guard, [request]() { return request->done; });
+}
+
+#ifdef __linux__
+
+static int64_t Now() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+EventLoop::EventLoop(VM* owner) : owner_(owner) {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+  for (int fd : {wake_fd_, timer_fd_}) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+  }
+
+  thread_ = std::thread(&EventLoop::Loop, this);
+}
+
+EventLoop::~EventLoop() {
+  {
+    std::lock_guard guard(lock_);
+    stopping_ = true;
+  }
+
+  uint64_t one = 1;
+  write(wake_fd_, &one, sizeof(one));
+
+  thread_.join();
+
+  close(timer_fd_);
+  close(wake_fd_);
+  close(epoll_fd_);
+}
+
+void EventLoop::Submit(IoRequest* request) {
+  {
+    std::lock_guard guard(lock_);
+    submitted_.push_back(request);
+  }
+
+  uint64_t one = 1;
+  write(wake_fd_, &one, sizeof(one));
+}
+
+void EventLoop::Loop() {
+  epoll_event events[64];
+
+  for (;;) {
+    int count = epoll_wait(epoll_fd_, events, std::size(events), -1);
+
+    for (int i = 0; i < count; ++i) {
+      int fd = events[i].data.fd;
+
+      if (fd == wake_fd_) {
+        uint64_t value;
+        read(wake_fd_, &value, sizeof(value));
+
+        std::vector<IoRequest*> submitted;
+        {
+          std::lock_guard guard(lock_);
+          if (stopping_) return;
+          submitted.swap(submitted_);
+        }
+
+        for (auto request : submitted) {
+          Start(request);
+        }
+      } else if (fd == timer_fd_) {
+        uint64_t expirations;
+        read(timer_fd_, &expirations, sizeof(expirations));
+        FireTimers();
+      } else {
+        OnReady(fd, events[i].events);
+      }
+    }
+  }
+}
+
+void EventLoop::Start(IoRequest* request) {
+  switch (request->kind) {
+    case IoRequest::Kind::Sleep:
+      timers_.push({Now() + static_cast<int64_t>(request->milliseconds * 1e6), request});
+      ArmTimer();
+      break;
+
+    case IoRequest::Kind::ReadFile:
+      ReadFile(request);
+      Complete(request);
+      break;
+
+    default:
+      WatchRequest(request);
+      break;
+  }
+}
+
+void EventLoop::WatchRequest(IoRequest* request) {
+  auto& watch = watches_[request->fd];
+  if (request->kind == IoRequest::Kind::Write) {
+    watch.writers.push_back(request);
+  } else {
+    watch.readers.push_back(request);
+  }
+
+  UpdateInterest(request->fd, watch);
+}
+
+void EventLoop::UpdateInterest(int fd, Watch& watch) {
+  uint32_t interest = (watch.readers.empty() ? 0 : EPOLLIN) | (watch.writers.empty() ? 0 : EPOLLOUT);
+
+  if (interest == 0) {
+    if (watch.registered) epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    watches_.erase(fd);
+    return;
+  }
+
+  epoll_event event{};
+  event.events = interest;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd_, watch.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event) == 0) {
+    watch.registered = true;
+    return;
+  }
+
+  // regular files are always ready, and a bad descriptor fails right away;
+  // either way the operation can be done now
+  for (auto queue : {&watch.readers, &watch.writers}) {
+    for (auto request : *queue) {
+      while (!Perform(request)) {
+      }
+      Complete(request);
+    }
+  }
+  watches_.erase(fd);
+}
+
+void EventLoop::OnReady(int fd, uint32_t events) {
+  auto iter = watches_.find(fd);
+  if (iter == watches_.end()) return;
+  auto& watch = iter->second;
+
+  // one operation per direction each time, the descriptor stays ready
+  IoRequest* ready[2] = {};
+  if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !watch.readers.empty() && Perform(watch.readers.front())) {
+    ready[0] = watch.readers.front();
+    watch.readers.pop_front();
+  }
+
+  if ((events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && !watch.writers.empty() && Perform(watch.writers.front())) {
+    ready[1] = watch.writers.front();
+    watch.writers.pop_front();
+  }
+
+  // before resuming anyone, who might close the descriptor
+  UpdateInterest(fd, watch);
+
+  for (auto request : ready) {
+    if (request != nullptr) Complete(request);
+  }
+}
+
+void EventLoop::ArmTimer() {
+  itimerspec spec{};
+  if (!timers_.empty()) {
+    // an absolute deadline of zero would disarm the timer
+    int64_t deadline = std::max<int64_t>(timers_.top().first, 1);
+    spec.it_value.tv_sec = deadline / 1000000000LL;
+    spec.it_value.tv_nsec = deadline % 1000000000LL;
+  }
+  timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+void EventLoop::FireTimers() {
+  int64_t now = Now();
+  while (!timers_.empty() && timers_.top().first <= now) {
+    auto request = timers_.top().second;
+    timers_.pop();
+    Complete(request);
+  }
+
+  ArmTimer();
+}
+
+#else
+
+// Without epoll every request is carried out as it is submitted, blocking the
+// thread that submitted it.
+EventLoop::EventLoop(VM* owner) : owner_(owner) {}
+
+EventLoop::~EventLoop() = default;
+
+void EventLoop::Submit(IoRequest* request) {
+  switch (request->kind) {
+    case IoRequest::Kind::Sleep:
+      std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(request->milliseconds));
+      break;
+
+    case IoRequest::Kind::ReadFile:
+      ReadFile(request);
+      break;
+
+    default: {
+      int flags = fcntl(request->fd, F_GETFL);
+      fcntl(request->fd, F_SETFL, flags & ~O_NONBLOCK);
+      while (!Perform(request)) {
+      }
+      fcntl(request->fd, F_SETFL, flags);
+      break;
+    }
+  }
+
+  Complete(request);
+}
+
+#endif
+
+static bool IsNumberArgument(int argc, Value* argv, int index) { return index < argc && IsNumber(argv[index]); }
+
+static bool IsStringArgument(int argc, Value* argv, int index) { return index < argc && IsString(argv[index]); }
+
+// the caller resumes with the request's result in place of the call
+static Value Suspend(VM* vm, IoRequest* request) {
+  vm->suspend = VM::Suspend::Io;
+  vm->io_request = request;
+  return Nil{};
+}
+
+static Value Sleep(VM* vm, int argc, Value* argv) {
+  if (!IsNumberArgument(argc, argv, 0)) return Nil{};
+
+  auto request = new IoRequest{.kind = IoRequest::Kind::Sleep};
+  request->milliseconds = AsNumber(argv[0]);
+  return Suspend(vm, request);
+}
+
+static Value Read(VM* vm, int argc, Value* argv) {
+  if (!IsNumberArgument(argc, argv, 0) || !IsNumberArgument(argc, argv, 1)) return Nil{};
+
+  auto request = new IoRequest{.kind = IoRequest::Kind::Read};
+  request->fd = AsNumber(argv[0]);
+  request->size = AsNumber(argv[1]);
+  return Suspend(vm, request);
+}
+
+static Value Write(VM* vm, int argc, Value* argv) {
+  if (!IsNumberArgument(argc, argv, 0) || !IsStringArgument(argc, argv, 1)) return Nil{};
+
+  auto request = new IoRequest{.kind = IoRequest::Kind::Write};
+  request->fd = AsNumber(argv[0]);
+  request->data = AsString(argv[1])->GetString();
+  return Suspend(vm, request);
+}
+
+static Value ReadWholeFile(VM* vm, int argc, Value* argv) {
+  if (!IsStringArgument(argc, argv, 0)) return Nil{};
+
+  auto request = new IoRequest{.kind = IoRequest::Kind::ReadFile};
+  request->data = AsString(argv[0])->GetString();
+  return Suspend(vm, request);
+}
+
+static Value Accept(VM* vm, int argc, Value* argv) {
+  if (!IsNumberArgument(argc, argv, 0)) return Nil{};
+
+  auto request = new IoRequest{.kind = IoRequest::Kind::Accept};
+  request->fd = AsNumber(argv[0]);
+  return Suspend(vm, request);
+}
+
+static bool MakeAddress(Value path, sockaddr_un* addr) {
+  auto name = AsString(path);
+  if (name->length >= (int)sizeof(addr->sun_path)) return false;
+
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, name->content, name->length + 1);
+  return true;
+}
+
+// listen(path) binds a Unix socket, replacing whatever was at path
+static Value Listen(VM* vm, int argc, Value* argv) {
+  sockaddr_un addr{};
+  if (!IsStringArgument(argc, argv, 0) || !MakeAddress(argv[0], &addr)) return Nil{};
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(addr.sun_path);
+  if (fd == -1 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+    if (fd != -1) close(fd);
+    return Nil{};
+  }
+
+  SetNonBlocking(fd);
+  return static_cast<double>(fd);
+}
+
+static Value Connect(VM* vm, int argc, Value* argv) {
+  sockaddr_un addr{};
+  if (!IsStringArgument(argc, argv, 0) || !MakeAddress(argv[0], &addr)) return Nil{};
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+    if (fd != -1) close(fd);
+    return Nil{};
+  }
+
+  SetNonBlocking(fd);
+  return static_cast<double>(fd);
+}
+
+static Value Close(VM* vm, int argc, Value* argv) {
+  if (!IsNumberArgument(argc, argv, 0)) return Nil{};
+  return close(AsNumber(argv[0])) == 0;
+}
+
+void RegisterIoNatives(VM* vm) {
+  vm->DefineNativeFunction("sleep", &Sleep, 1);
+  vm->DefineNativeFunction("read", &Read, 2);
+  vm->DefineNativeFunction("write", &Write, 2);
+  vm->DefineNativeFunction("readFile", &ReadWholeFile, 1);
+  vm->DefineNativeFunction("accept", &Accept, 1);
+  vm->DefineNativeFunction("listen", &Listen, 1);
+  vm->DefineNativeFunction("connect", &Connect, 1);
+  vm->DefineNativeFunction("close", &Close, 1);
+}
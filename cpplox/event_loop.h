@@ -0,0 +1,109 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "value.h"
+
+class VM;
+struct Fiber;
+
+// An operation an async native handed to the event loop. The code that made
+// the call stays suspended until it completes: a fiber is parked and later
+// requeued, the top-level script blocks. The loop's thread never touches a
+// VM heap, so the result is only turned into a Value by whoever resumes.
+struct IoRequest {
+  enum class Kind { Sleep, Read, Write, ReadFile, Accept };
+
+  Kind kind;
+  int fd{-1};
+  double milliseconds{};
+  // bytes to write, path to read, or what was read
+  std::string data;
+  // most bytes to read, or how many have been written
+  size_t size{};
+  // -1 on error
+  ssize_t result{};
+
+  // resumed when the request completes, or null for a blocked thread
+  Fiber* fiber{};
+
+  std::mutex lock;
+  std::condition_variable completed;
+  bool done{};
+
+  Value ToValue(VM* vm);
+};
+
+// Waits on descriptors with epoll and on sleeps with a single timerfd, from
+// its own thread, so any number of fibers can be waiting on I/O without
+// holding a scheduler thread. Regular files can't be polled and are read on
+// the loop's thread.
+class EventLoop {
+ public:
+  explicit EventLoop(VM* owner);
+
+  ~EventLoop();
+
+  // takes ownership until the request is resumed
+  void Submit(IoRequest* request);
+
+  // submits and blocks the calling thread until the request completes
+  void Wait(IoRequest* request);
+
+ private:
+  struct Watch {
+    std::deque<IoRequest*> readers;
+    std::deque<IoRequest*> writers;
+    bool registered{};
+  };
+
+  using Timer = std::pair<int64_t, IoRequest*>;
+
+  void Loop();
+
+  void Start(IoRequest* request);
+
+  void WatchRequest(IoRequest* request);
+
+  void UpdateInterest(int fd, Watch& watch);
+
+  void OnReady(int fd, uint32_t events);
+
+  void ArmTimer();
+
+  void FireTimers();
+
+  void Complete(IoRequest* request);
+
+  VM* owner_;
+
+  int epoll_fd_{-1};
+  // written to after a Submit to wake the loop
+  int wake_fd_{-1};
+  int timer_fd_{-1};
+
+  std::mutex lock_;
+  std::vector<IoRequest*> submitted_;
+  bool stopping_{};
+
+  // only touched on the loop's thread
+  std::unordered_map<int, Watch> watches_;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+
+  std::thread thread_;
+};
+
+// sleep(ms), read(fd, max), write(fd, string), readFile(path), accept(fd)
+// suspend the caller; listen(path), connect(path) and close(fd) don't
+void RegisterIoNatives(VM* vm);
@@ -3,22 +3,44 @@
 #include <ctime>
 #include <functional>
 
+#include "channel.h"
+#include "collection.h"
+#include "event_loop.h"
+#include "float64_array.h"
+#include "foreign.h"
+#include "intrinsic.h"
+#include "parallel.h"
+#include "scheduler.h"
 #include "value.h"
 #include "vm.h"
 
-inline void DefineNativeFunction(const char* name, NativeFunctor func) {
-  auto vm = VM::GetInstance();
+inline Value Unix(VM* vm, int argc, Value* argv) {
+  int t = time(nullptr);
+  printf("TimeStamp: %d\n", t);
+  return (double)t;
+}
 
-  String* str = reinterpret_cast<String*>(std::get<Object*>(vm->AllocateString(name)));
-  Object* nf = NewNativeFunction(str, func);
+// done(generator) is true once the generator has returned
+inline Value GeneratorDone(VM* vm, int argc, Value* argv) {
+  if (argc != 1 || !std::holds_alternative<Object*>(argv[0])) return Nil{};
 
-  vm->InsertObject(nf);
+  auto object = std::get<Object*>(argv[0]);
+  if (object->type != ObjectType::Generator) return Nil{};
 
-  vm->globals.insert({str->hash, nf});
+  return reinterpret_cast<Generator*>(object)->done;
 }
 
-inline Value Unix(int argc, Value* argv) {
-  int t = time(nullptr);
-  printf("TimeStamp: %d\n", t);
-  return (double)t;
+// natives every VM starts with
+inline void RegisterNatives(VM* vm) {
+  vm->DefineNativeFunction("unix", &Unix, 0);
+  vm->DefineNativeFunction("done", &GeneratorDone, 1);
+
+  RegisterMathNatives(vm);
+  RegisterFloat64ArrayNatives(vm);
+  RegisterCollectionNatives(vm);
+  RegisterFiberNatives(vm);
+  RegisterIoNatives(vm);
+  RegisterChannelNatives(vm);
+  RegisterParallelNatives(vm);
+  RegisterForeignNatives(vm);
 }
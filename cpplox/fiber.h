@@ -0,0 +1,40 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "event_loop.h"
+#include "value.h"
+#include "vm.h"
+
+// A closure running on its own value stack and call frames. While a worker
+// runs the fiber its state is swapped into the worker's VM, otherwise it is
+// kept here. Stacks are only allocated once the fiber first runs.
+struct Fiber : Object {
+  // much smaller than a VM's own, thousands may be parked at once
+  inline static constexpr int STACK_SIZE = 1 << 16;
+  inline static constexpr int FRAMES_SIZE = 1 << 12;
+
+  Closure* closure;
+  bool started{};
+
+  Stack<Value> stack;
+  Value* stack_top;
+  Stack<VM::CallFrame> frames;
+  VM::CallFrame* frame_pointer;
+  VM::OpenUpvalues open_upvalues;
+
+  // completed I/O whose result the fiber resumes with
+  IoRequest* io{};
+
+  // guards the fields below, a fiber can be joined from any thread
+  std::mutex lock;
+  std::condition_variable finished;
+  bool done{};
+  Value result;
+  // fibers parked in join() until this one is done
+  std::vector<Fiber*> waiters;
+
+  explicit Fiber(Closure* closure) : closure(closure) { type = ObjectType::Fiber; }
+};
@@ -0,0 +1,340 @@
+#include "float64_array.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "intrinsic.h"
+#include "vm.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define FLOAT64_ARRAY_AVX2
+#endif
+
+Float64Array::Float64Array(size_t length) : length(length) {
+  type = ObjectType::Float64Array;
+
+  // aligned_alloc wants a multiple of the alignment, and something to point at
+  size_t size = (length * sizeof(double) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+  size = std::max(size, ALIGNMENT);
+  data = static_cast<double*>(std::aligned_alloc(ALIGNMENT, size));
+  std::fill_n(data, length, 0.0);
+}
+
+Float64Array::~Float64Array() { std::free(data); }
+
+namespace {
+
+// Reductions keep this many partial sums, element i going to lane i % kLanes,
+// and add the lanes up in order at the end. The AVX2 kernels hold them in four
+// registers of four, so both paths round identically and results don't
+// depend on the machine.
+constexpr size_t kLanes = 16;
+
+double AddLanes(const double* lanes) {
+  double total = 0;
+  for (size_t i = 0; i < kLanes; ++i) total += lanes[i];
+  return total;
+}
+
+double SumScalar(const double* x, size_t n, double* lanes) {
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    for (size_t j = 0; j < kLanes; ++j) lanes[j] += x[i + j];
+  }
+  for (size_t j = 0; i + j < n; ++j) lanes[j] += x[i + j];
+  return AddLanes(lanes);
+}
+
+double DotScalar(const double* x, const double* y, size_t n, double* lanes) {
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    for (size_t j = 0; j < kLanes; ++j) lanes[j] = std::fma(x[i + j], y[i + j], lanes[j]);
+  }
+  for (size_t j = 0; i + j < n; ++j) lanes[j] = std::fma(x[i + j], y[i + j], lanes[j]);
+  return AddLanes(lanes);
+}
+
+void ScaleScalar(double* x, size_t n, double k) {
+  for (size_t i = 0; i < n; ++i) x[i] *= k;
+}
+
+void AxpyScalar(double alpha, const double* x, double* y, size_t n) {
+  for (size_t i = 0; i < n; ++i) y[i] = std::fma(alpha, x[i], y[i]);
+}
+
+double (*UnaryFunction(Intrinsic intrinsic))(double) {
+  switch (intrinsic) {
+    case Intrinsic::Sqrt:
+      return [](double x) { return std::sqrt(x); };
+    case Intrinsic::Floor:
+      return [](double x) { return std::floor(x); };
+    case Intrinsic::Ceil:
+      return [](double x) { return std::ceil(x); };
+    case Intrinsic::Abs:
+      return [](double x) { return std::fabs(x); };
+    case Intrinsic::Sin:
+      return [](double x) { return std::sin(x); };
+    case Intrinsic::Cos:
+      return [](double x) { return std::cos(x); };
+    case Intrinsic::Exp:
+      return [](double x) { return std::exp(x); };
+    case Intrinsic::Log:
+      return [](double x) { return std::log(x); };
+    default:
+      return nullptr;
+  }
+}
+
+#ifdef FLOAT64_ARRAY_AVX2
+
+// Arrays are 64-byte aligned and the main loops step 16 doubles, so every
+// vector load is aligned. The tails go to the scalar code, which carries on
+// with the same lanes.
+
+__attribute__((target("avx2,fma"))) double SumAvx2(const double* x, size_t n) {
+  __m256d acc[4] = {_mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd()};
+
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    for (int k = 0; k < 4; ++k) acc[k] = _mm256_add_pd(acc[k], _mm256_load_pd(x + i + 4 * k));
+  }
+
+  double lanes[kLanes];
+  for (int k = 0; k < 4; ++k) _mm256_storeu_pd(lanes + 4 * k, acc[k]);
+  return SumScalar(x + i, n - i, lanes);
+}
+
+__attribute__((target("avx2,fma"))) double DotAvx2(const double* x, const double* y, size_t n) {
+  __m256d acc[4] = {_mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd()};
+
+  size_t i = 0;
+  for (; i + kLanes <= n; i += kLanes) {
+    for (int k = 0; k < 4; ++k) {
+      acc[k] = _mm256_fmadd_pd(_mm256_load_pd(x + i + 4 * k), _mm256_load_pd(y + i + 4 * k), acc[k]);
+    }
+  }
+
+  double lanes[kLanes];
+  for (int k = 0; k < 4; ++k) _mm256_storeu_pd(lanes + 4 * k, acc[k]);
+  return DotScalar(x + i, y + i, n - i, lanes);
+}
+
+__attribute__((target("avx2,fma"))) void ScaleAvx2(double* x, size_t n, double k) {
+  auto factor = _mm256_set1_pd(k);
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) _mm256_store_pd(x + i, _mm256_mul_pd(_mm256_load_pd(x + i), factor));
+  ScaleScalar(x + i, n - i, k);
+}
+
+__attribute__((target("avx2,fma"))) void AxpyAvx2(double alpha, const double* x, double* y, size_t n) {
+  auto a = _mm256_set1_pd(alpha);
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_store_pd(y + i, _mm256_fmadd_pd(a, _mm256_load_pd(x + i), _mm256_load_pd(y + i)));
+  }
+  AxpyScalar(alpha, x + i, y + i, n - i);
+}
+
+// the intrinsics with a vector instruction, false for the others
+__attribute__((target("avx2,fma"))) bool MapAvx2(Intrinsic intrinsic, const double* x, double* y, size_t n) {
+  auto sign = _mm256_set1_pd(-0.0);
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    auto v = _mm256_load_pd(x + i);
+    switch (intrinsic) {
+      case Intrinsic::Sqrt:
+        v = _mm256_sqrt_pd(v);
+        break;
+      case Intrinsic::Floor:
+        v = _mm256_round_pd(v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        break;
+      case Intrinsic::Ceil:
+        v = _mm256_round_pd(v, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC);
+        break;
+      case Intrinsic::Abs:
+        v = _mm256_andnot_pd(sign, v);
+        break;
+      default:
+        return false;
+    }
+    _mm256_store_pd(y + i, v);
+  }
+
+  auto function = UnaryFunction(intrinsic);
+  for (; i < n; ++i) y[i] = function(x[i]);
+  return true;
+}
+
+// checked before main, so the cpu model may not be initialized yet
+const bool has_avx2 = []() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}();
+
+#endif
+
+double Sum(const double* x, size_t n) {
+#ifdef FLOAT64_ARRAY_AVX2
+  if (has_avx2) return SumAvx2(x, n);
+#endif
+  double lanes[kLanes]{};
+  return SumScalar(x, n, lanes);
+}
+
+double Dot(const double* x, const double* y, size_t n) {
+#ifdef FLOAT64_ARRAY_AVX2
+  if (has_avx2) return DotAvx2(x, y, n);
+#endif
+  double lanes[kLanes]{};
+  return DotScalar(x, y, n, lanes);
+}
+
+void Scale(double* x, size_t n, double k) {
+#ifdef FLOAT64_ARRAY_AVX2
+  if (has_avx2) return ScaleAvx2(x, n, k);
+#endif
+  ScaleScalar(x, n, k);
+}
+
+void Axpy(double alpha, const double* x, double* y, size_t n) {
+#ifdef FLOAT64_ARRAY_AVX2
+  if (has_avx2) return AxpyAvx2(alpha, x, y, n);
+#endif
+  AxpyScalar(alpha, x, y, n);
+}
+
+void Map(Intrinsic intrinsic, const double* x, double* y, size_t n) {
+#ifdef FLOAT64_ARRAY_AVX2
+  if (has_avx2 && MapAvx2(intrinsic, x, y, n)) return;
+#endif
+  auto function = UnaryFunction(intrinsic);
+  for (size_t i = 0; i < n; ++i) y[i] = function(x[i]);
+}
+
+Float64Array* NewArray(VM* vm, size_t length) {
+  auto array = new Float64Array(length);
+  vm->InsertObject(array);
+  return array;
+}
+
+Value NewFloat64Array(VM* vm, int argc, Value* argv) {
+  if (!IsNumber(argv[0]) || AsNumber(argv[0]) < 0 || AsNumber(argv[0]) != std::floor(AsNumber(argv[0]))) {
+    vm->RuntimeError("Float64Array expects a length.");
+    return Nil{};
+  }
+  return NewArray(vm, AsNumber(argv[0]));
+}
+
+// the arrays among argv[first..first + count), or a runtime error naming native
+bool CheckArrays(VM* vm, Value* argv, int first, int count, const char* native) {
+  for (int i = first; i < first + count; ++i) {
+    if (!IsFloat64Array(argv[i])) {
+      vm->RuntimeError("%s expects a Float64Array as argument %d.", native, i + 1);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool CheckNumber(VM* vm, Value* argv, int index, const char* native) {
+  if (IsNumber(argv[index])) return true;
+
+  vm->RuntimeError("%s expects a number as argument %d.", native, index + 1);
+  return false;
+}
+
+bool CheckSameLength(VM* vm, Float64Array* a, Float64Array* b, const char* native) {
+  if (a->length == b->length) return true;
+
+  vm->RuntimeError("%s expects arrays of the same length, got %zu and %zu.", native, a->length, b->length);
+  return false;
+}
+
+Value SumNative(VM* vm, int argc, Value* argv) {
+  if (!CheckArrays(vm, argv, 0, 1, "sum")) return Nil{};
+
+  auto array = AsFloat64Array(argv[0]);
+  return Sum(array->data, array->length);
+}
+
+Value DotNative(VM* vm, int argc, Value* argv) {
+  if (!CheckArrays(vm, argv, 0, 2, "dot")) return Nil{};
+
+  auto a = AsFloat64Array(argv[0]);
+  auto b = AsFloat64Array(argv[1]);
+  if (!CheckSameLength(vm, a, b, "dot")) return Nil{};
+
+  return Dot(a->data, b->data, a->length);
+}
+
+// scales a in place
+Value ScaleNative(VM* vm, int argc, Value* argv) {
+  if (!CheckArrays(vm, argv, 0, 1, "scale") || !CheckNumber(vm, argv, 1, "scale")) return Nil{};
+
+  auto array = AsFloat64Array(argv[0]);
+  Scale(array->data, array->length, AsNumber(argv[1]));
+  return array;
+}
+
+// y = alpha * x + y, in place
+Value AxpyNative(VM* vm, int argc, Value* argv) {
+  if (!CheckNumber(vm, argv, 0, "axpy") || !CheckArrays(vm, argv, 1, 2, "axpy")) return Nil{};
+
+  auto x = AsFloat64Array(argv[1]);
+  auto y = AsFloat64Array(argv[2]);
+  if (!CheckSameLength(vm, x, y, "axpy")) return Nil{};
+
+  Axpy(AsNumber(argv[0]), x->data, y->data, x->length);
+  return y;
+}
+
+// a new array of fn applied to each element; fn is one of the maths natives
+// taking one number
+Value MapNative(VM* vm, int argc, Value* argv) {
+  if (!CheckArrays(vm, argv, 0, 1, "map")) return Nil{};
+
+  auto intrinsic = Intrinsic::Count;
+  auto fn = std::holds_alternative<Object*>(argv[1]) ? std::get<Object*>(argv[1]) : nullptr;
+  if (fn != nullptr && fn->type == ObjectType::NativeFunction) {
+    auto native = reinterpret_cast<NativeFunction*>(fn);
+    if (native->intrinsic != -1) intrinsic = static_cast<Intrinsic>(native->intrinsic);
+  }
+
+  if (UnaryFunction(intrinsic) == nullptr) {
+    vm->RuntimeError("map expects sqrt, floor, ceil, abs, sin, cos, exp or log.");
+    return Nil{};
+  }
+
+  auto source = AsFloat64Array(argv[0]);
+  auto result = NewArray(vm, source->length);
+  Map(intrinsic, source->data, result->data, source->length);
+  return result;
+}
+
+// sorts a in place, NaNs last
+Value SortNative(VM* vm, int argc, Value* argv) {
+  if (!CheckArrays(vm, argv, 0, 1, "sort")) return Nil{};
+
+  auto array = AsFloat64Array(argv[0]);
+  auto end = array->data + array->length;
+  auto numbers_end = std::partition(array->data, end, [](double x) { return !std::isnan(x); });
+  std::sort(array->data, numbers_end);
+  return array;
+}
+
+}  // namespace
+
+void RegisterFloat64ArrayNatives(VM* vm) {
+  vm->DefineNativeFunction("Float64Array", &NewFloat64Array, 1);
+  vm->DefineNativeFunction("sum", &SumNative, 1);
+  vm->DefineNativeFunction("dot", &DotNative, 2);
+  vm->DefineNativeFunction("scale", &ScaleNative, 2);
+  vm->DefineNativeFunction("axpy", &AxpyNative, 3);
+  vm->DefineNativeFunction("map", &MapNative, 2);
+  vm->DefineNativeFunction("sort", &SortNative, 1);
+}
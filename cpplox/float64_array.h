@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+
+#include "value.h"
+
+// A fixed-length array of doubles in one 64-byte aligned buffer, indexed with
+// a[i] and processed in bulk by the natives below.
+struct Float64Array : Object {
+  inline static constexpr size_t ALIGNMENT = 64;
+
+  double* data{};
+  size_t length{};
+
+  // zero filled
+  explicit Float64Array(size_t length);
+
+  ~Float64Array();
+
+  Float64Array(const Float64Array&) = delete;
+  Float64Array& operator=(const Float64Array&) = delete;
+};
+
+inline bool IsFloat64Array(Value value) {
+  return std::holds_alternative<Object*>(value) && std::get<Object*>(value)->type == ObjectType::Float64Array;
+}
+
+inline Float64Array* AsFloat64Array(Value value) {
+  return reinterpret_cast<Float64Array*>(std::get<Object*>(value));
+}
+
+// Float64Array(length), sum(a), dot(a, b), scale(a, k), axpy(alpha, x, y),
+// map(a, fn) and sort(a); len is with the collection natives
+void RegisterFloat64ArrayNatives(VM* vm);
@@ -0,0 +1,315 @@
+#include "foreign.h"
+
+#include <dlfcn.h>
+
+#include <array>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "vm.h"
+
+namespace {
+
+using Type = Foreign::Type;
+
+std::string_view Trim(std::string_view text) {
+  auto begin = text.find_first_not_of(" \t");
+  if (begin == std::string_view::npos) return {};
+  return text.substr(begin, text.find_last_not_of(" \t") - begin + 1);
+}
+
+bool ParseType(std::string_view name, Type* type) {
+  static const std::unordered_map<std::string_view, Type> types = {
+      {"nil", Type::Nil},   {"number", Type::Number}, {"int", Type::Int},
+      {"bool", Type::Bool}, {"string", Type::String},
+  };
+
+  auto iter = types.find(Trim(name));
+  if (iter == types.end()) return false;
+
+  *type = iter->second;
+  return true;
+}
+
+const char* TypeName(Type type) {
+  switch (type) {
+    case Type::Nil:
+      return "nil";
+    case Type::Number:
+      return "number";
+    case Type::Int:
+      return "int";
+    case Type::Bool:
+      return "bool";
+    case Type::String:
+      return "string";
+  }
+  return "";
+}
+
+// How an argument or result is passed in C. A bool travels as an int, the
+// way most C interfaces spell it, and any nonzero result is true.
+enum class Pass : uint8_t { Double, Int, Pointer, Void };
+
+template <Pass P>
+struct CType;
+template <>
+struct CType<Pass::Double> {
+  using type = double;
+};
+template <>
+struct CType<Pass::Int> {
+  using type = int;
+};
+template <>
+struct CType<Pass::Pointer> {
+  using type = const char*;
+};
+template <>
+struct CType<Pass::Void> {
+  using type = void;
+};
+
+Pass PassOf(Type type) {
+  switch (type) {
+    case Type::Nil:
+      return Pass::Void;
+    case Type::Number:
+      return Pass::Double;
+    case Type::Int:
+    case Type::Bool:
+      return Pass::Int;
+    case Type::String:
+      return Pass::Pointer;
+  }
+  return Pass::Void;
+}
+
+NativeFunction* GetNative(Value* argv) {
+  return reinterpret_cast<NativeFunction*>(std::get<Object*>(argv[-1]));
+}
+
+Value ArgumentError(VM* vm, Value* argv, int index) {
+  auto native = GetNative(argv);
+  vm->RuntimeError("%s expects a %s as argument %d.", native->name->GetCString(),
+                   TypeName(native->foreign->params[index]), index + 1);
+  return Nil{};
+}
+
+// the index of the first argument that isn't of its parameter's type, -1 if there is none
+int FindWrongArgument(const Foreign* foreign, Value* argv) {
+  for (size_t i = 0; i < foreign->params.size(); ++i) {
+    auto value = argv[i];
+
+    bool matches = false;
+    switch (foreign->params[i]) {
+      case Type::Number:
+      case Type::Int:
+        matches = IsNumber(value);
+        break;
+      case Type::Bool:
+        matches = std::holds_alternative<bool>(value);
+        break;
+      case Type::String:
+        matches = IsString(value);
+        break;
+      case Type::Nil:
+        break;
+    }
+    if (!matches) return i;
+  }
+  return -1;
+}
+
+// an argument already checked by FindWrongArgument, as the C type it is passed as
+template <Pass P>
+typename CType<P>::type Unbox(Value value) {
+  if constexpr (P == Pass::Double) {
+    return AsNumber(value);
+  } else if constexpr (P == Pass::Int) {
+    if (std::holds_alternative<bool>(value)) return std::get<bool>(value);
+    return static_cast<int>(AsNumber(value));
+  } else {
+    return AsString(value)->content;
+  }
+}
+
+Value Box(VM* vm, Type type, double result) { return result; }
+
+Value Box(VM* vm, Type type, int result) {
+  if (type == Type::Bool) return result != 0;
+  return static_cast<double>(result);
+}
+
+Value Box(VM* vm, Type type, const char* result) {
+  return result != nullptr ? vm->AllocateString(result) : Value(Nil{});
+}
+
+// Every parameter list up to Foreign::PARAMS_MAX long, numbered shortest
+// first, has a trampoline that calls the symbol through its real C type.
+// Parameter i of shape s is digit i of s's position among the shapes of its
+// length, in base kParamPasses.
+constexpr size_t kParamPasses = 3;
+
+constexpr size_t ShapeOffset(size_t count) {
+  size_t offset = 0;
+  size_t width = 1;
+  for (size_t i = 0; i < count; ++i) {
+    offset += width;
+    width *= kParamPasses;
+  }
+  return offset;
+}
+
+constexpr size_t kShapes = ShapeOffset(Foreign::PARAMS_MAX + 1);
+
+constexpr size_t ShapeLength(size_t shape) {
+  size_t count = 0;
+  while (ShapeOffset(count + 1) <= shape) ++count;
+  return count;
+}
+
+constexpr Pass ShapeParam(size_t shape, size_t index) {
+  auto code = shape - ShapeOffset(ShapeLength(shape));
+  for (size_t i = 0; i < index; ++i) code /= kParamPasses;
+  return static_cast<Pass>(code % kParamPasses);
+}
+
+template <Pass R, size_t S>
+Value ShapeTrampoline(VM* vm, int argc, Value* argv) {
+  auto foreign = GetNative(argv)->foreign;
+  if (auto wrong = FindWrongArgument(foreign, argv); wrong >= 0) return ArgumentError(vm, argv, wrong);
+
+  return [&]<size_t... I>(std::index_sequence<I...>) -> Value {
+    using Function = typename CType<R>::type (*)(typename CType<ShapeParam(S, I)>::type...);
+    auto function = reinterpret_cast<Function>(foreign->symbol);
+
+    if constexpr (R == Pass::Void) {
+      function(Unbox<ShapeParam(S, I)>(argv[I])...);
+      return Nil{};
+    } else {
+      return Box(vm, foreign->result, function(Unbox<ShapeParam(S, I)>(argv[I])...));
+    }
+  }(std::make_index_sequence<ShapeLength(S)>());
+}
+
+template <Pass R, size_t... S>
+constexpr std::array<NativeFn, kShapes> ShapeTrampolines(std::index_sequence<S...>) {
+  return {&ShapeTrampoline<R, S>...};
+}
+
+template <Pass R>
+constexpr auto shape_trampolines = ShapeTrampolines<R>(std::make_index_sequence<kShapes>());
+
+// libraries stay loaded until exit, natives bound on any VM may call into them
+std::mutex libraries_lock;
+std::unordered_map<std::string, void*> libraries;
+
+void* OpenLibrary(const std::string& path) {
+  std::lock_guard guard(libraries_lock);
+
+  auto& library = libraries[path];
+  if (library == nullptr) {
+    // an empty path is the program itself and the libraries it links
+    library = dlopen(path.empty() ? nullptr : path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  }
+  return library;
+}
+
+Value BindForeign(VM* vm, int argc, Value* argv) {
+  if (!IsString(argv[0]) || !IsString(argv[1]) || !IsString(argv[2])) {
+    vm->RuntimeError("foreign expects a library path, a symbol name and a signature.");
+    return Nil{};
+  }
+
+  auto path = AsString(argv[0]);
+  auto symbol = AsString(argv[1]);
+  auto signature = AsString(argv[2]);
+
+  // the call would have to say how many of the arguments are in vector registers
+  if (signature->GetString().find("...") != std::string::npos) {
+    vm->RuntimeError("Can't bind '%s', variadic functions aren't supported.", symbol->GetCString());
+    return Nil{};
+  }
+
+  auto foreign = std::make_unique<Foreign>();
+  if (!foreign->Parse(signature->GetString())) {
+    vm->RuntimeError("Malformed signature '%s'.", signature->GetCString());
+    return Nil{};
+  }
+
+  auto trampoline = foreign->GetTrampoline();
+  if (trampoline == nullptr) {
+    vm->RuntimeError("Can't call a function with more than %zu parameters.", Foreign::PARAMS_MAX);
+    return Nil{};
+  }
+
+  auto library = OpenLibrary(path->GetString());
+  if (library == nullptr) {
+    vm->RuntimeError("Can't load '%s': %s", path->GetCString(), dlerror());
+    return Nil{};
+  }
+
+  foreign->symbol = dlsym(library, symbol->GetCString());
+  if (foreign->symbol == nullptr) {
+    vm->RuntimeError("Can't find '%s' in '%s'.", symbol->GetCString(), path->GetCString());
+    return Nil{};
+  }
+
+  auto native = NewNativeFunction(symbol, trampoline, foreign->params.size());
+  native->foreign = foreign.release();
+  vm->InsertObject(native);
+
+  return native;
+}
+
+}  // namespace
+
+bool Foreign::Parse(std::string_view signature) {
+  signature = Trim(signature);
+  auto open = signature.find('(');
+  if (open == std::string_view::npos || signature.back() != ')') return false;
+
+  if (!ParseType(signature.substr(0, open), &result)) return false;
+
+  auto list = signature.substr(open + 1, signature.size() - open - 2);
+  params.clear();
+  if (Trim(list).empty()) return true;
+
+  for (;;) {
+    auto comma = list.find(',');
+
+    Type type;
+    if (!ParseType(list.substr(0, comma), &type) || type == Type::Nil) return false;
+    params.push_back(type);
+
+    if (comma == std::string_view::npos) return true;
+    list.remove_prefix(comma + 1);
+  }
+}
+
+NativeFn Foreign::GetTrampoline() const {
+  if (params.size() > PARAMS_MAX) return nullptr;
+
+  size_t code = 0;
+  for (auto type = params.rbegin(); type != params.rend(); ++type) {
+    code = code * kParamPasses + static_cast<size_t>(PassOf(*type));
+  }
+  auto shape = ShapeOffset(params.size()) + code;
+
+  switch (PassOf(result)) {
+    case Pass::Double:
+      return shape_trampolines<Pass::Double>[shape];
+    case Pass::Int:
+      return shape_trampolines<Pass::Int>[shape];
+    case Pass::Pointer:
+      return shape_trampolines<Pass::Pointer>[shape];
+    case Pass::Void:
+      return shape_trampolines<Pass::Void>[shape];
+  }
+  return nullptr;
+}
+
+void RegisterForeignNatives(VM* vm) { vm->DefineNativeFunction("foreign", &BindForeign, 3); }
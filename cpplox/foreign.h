@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "value.h"
+
+// A C function bound from a shared library with
+//
+//   var hypot = foreign("libm.so.6", "hypot", "number(number, number)");
+//
+// Arguments and the result are number (double), int (int), bool (int, true
+// when nonzero) or string (const char*, copied on return), and the result may
+// also be nil (void). Variadic functions aren't supported, a signature with
+// "..." is rejected.
+struct Foreign {
+  enum class Type : uint8_t { Nil, Number, Int, Bool, String };
+
+  // there is a trampoline for every list of up to this many parameters
+  inline static constexpr size_t PARAMS_MAX = 5;
+
+  void* symbol{};
+  Type result{};
+  std::vector<Type> params;
+
+  // parses "result(param, ...)", false if signature is malformed
+  bool Parse(std::string_view signature);
+
+  // the trampoline for this signature, nullptr if it has too many parameters
+  NativeFn GetTrampoline() const;
+};
+
+// foreign(library, symbol, signature)
+void RegisterForeignNatives(VM* vm);
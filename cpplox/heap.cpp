@@ -0,0 +1,95 @@
+#include "heap.h"
+
+#include <algorithm>
+
+#include "channel.h"
+#include "chunk.h"
+#include "class.h"
+#include "collection.h"
+#include "fiber.h"
+#include "float64_array.h"
+#include "foreign.h"
+
+static void FreeObject(Object* object) {
+  switch (object->type) {
+    case ObjectType::String: {
+      auto string = reinterpret_cast<String*>(object);
+      string->~String();
+      ::operator delete(string);
+      break;
+    }
+    case ObjectType::Function:
+      Function::Free(reinterpret_cast<Function*>(object));
+      break;
+    case ObjectType::NativeFunction: {
+      auto native = reinterpret_cast<NativeFunction*>(object);
+      delete native->foreign;
+      delete native;
+      break;
+    }
+    case ObjectType::Closure:
+      Closure::Free(reinterpret_cast<Closure*>(object));
+      break;
+    case ObjectType::Upvalue:
+      delete reinterpret_cast<Upvalue*>(object);
+      break;
+    case ObjectType::Fiber:
+      delete reinterpret_cast<Fiber*>(object);
+      break;
+    case ObjectType::Generator:
+      delete reinterpret_cast<Generator*>(object);
+      break;
+    case ObjectType::Float64Array:
+      delete reinterpret_cast<Float64Array*>(object);
+      break;
+    case ObjectType::List:
+      delete reinterpret_cast<List*>(object);
+      break;
+    case ObjectType::Map:
+      delete reinterpret_cast<Map*>(object);
+      break;
+    case ObjectType::Class:
+      delete reinterpret_cast<Class*>(object);
+      break;
+    case ObjectType::Instance:
+      delete reinterpret_cast<Instance*>(object);
+      break;
+    case ObjectType::BoundMethod:
+      delete reinterpret_cast<BoundMethod*>(object);
+      break;
+    case ObjectType::Channel:
+      // owned by the channel registry, never on a heap
+      break;
+  }
+}
+
+Heap::~Heap() {
+  while (objects != nullptr) {
+    auto next = objects->next;
+    FreeObject(objects);
+    objects = next;
+  }
+}
+
+Value Heap::AllocateString(std::string_view str) {
+  if (auto iter = strings.find(str); iter != strings.end()) {
+    return iter->second;
+  }
+
+  auto string = new (::operator new(sizeof(String) + str.length() + 1)) String;
+  string->hash = std::hash<std::string_view>{}(str);
+  string->length = str.length();
+  std::copy(str.begin(), str.end(), string->content);
+  string->content[str.length()] = '\0';
+
+  strings.insert({std::string_view(string->content, string->length), string});
+
+  InsertObject(string);
+
+  return string;
+}
+
+void Heap::InsertObject(Object* object) {
+  object->next = objects;
+  objects = object;
+}
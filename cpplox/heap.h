@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string_view>
+#include <unordered_map>
+
+#include "value.h"
+
+// Owns a list of objects and the strings interned among them. A VM is a heap
+// plus execution state; a compiled program is a heap on its own.
+class Heap {
+ public:
+  Heap() = default;
+
+  Heap(const Heap&) = delete;
+  Heap& operator=(const Heap&) = delete;
+
+  // frees every object on the heap
+  ~Heap();
+
+  Object* objects{};
+
+  // keys view the interned string's own content
+  std::unordered_map<std::string_view, String*> strings;
+
+  Value AllocateString(std::string_view str);
+
+  void InsertObject(Object* object);
+};
@@ -0,0 +1,44 @@
+#include "intrinsic.h"
+
+#include <array>
+#include <utility>
+
+#include "vm.h"
+
+Intrinsic FindIntrinsic(std::string_view name) {
+  for (size_t i = 0; i < std::size(INTRINSICS); ++i) {
+    if (name == INTRINSICS[i].name) return static_cast<Intrinsic>(i);
+  }
+  return Intrinsic::Count;
+}
+
+namespace {
+
+template <Intrinsic I>
+Value MathNative(VM* vm, int argc, Value* argv) {
+  Value result;
+  if (!EvaluateIntrinsic(I, argc, argv, &result)) {
+    vm->RuntimeError("%s expects numbers.", INTRINSICS[static_cast<size_t>(I)].name);
+    return Nil{};
+  }
+  return result;
+}
+
+template <size_t... I>
+constexpr std::array<NativeFn, sizeof...(I)> MathNatives(std::index_sequence<I...>) {
+  return {&MathNative<static_cast<Intrinsic>(I)>...};
+}
+
+constexpr auto math_natives = MathNatives(std::make_index_sequence<std::size(INTRINSICS)>());
+
+}  // namespace
+
+void RegisterMathNatives(VM* vm) {
+  for (size_t i = 0; i < std::size(INTRINSICS); ++i) {
+    vm->DefineNativeFunction(INTRINSICS[i].name, math_natives[i], INTRINSICS[i].arity);
+
+    Value native;
+    vm->GetGlobal(AsString(vm->AllocateString(INTRINSICS[i].name)), &native);
+    reinterpret_cast<NativeFunction*>(std::get<Object*>(native))->intrinsic = i;
+  }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <string_view>
+
+#include "value.h"
+
+// Maths natives the compiler turns into OP_INTRINSIC when called by their
+// global name. The opcode computes the result in place unless the global has
+// been assigned since, in which case it calls whatever the global holds.
+enum class Intrinsic : uint8_t {
+  Sqrt,
+  Floor,
+  Ceil,
+  Abs,
+  Min,
+  Max,
+  Pow,
+  Sin,
+  Cos,
+  Exp,
+  Log,
+  Clock,
+  Count,
+};
+
+struct IntrinsicInfo {
+  const char* name;
+  int arity;
+};
+
+inline constexpr IntrinsicInfo INTRINSICS[] = {
+    {"sqrt", 1}, {"floor", 1}, {"ceil", 1}, {"abs", 1}, {"min", 2}, {"max", 2},
+    {"pow", 2},  {"sin", 1},   {"cos", 1},  {"exp", 1}, {"log", 1}, {"clock", 0},
+};
+
+static_assert(std::size(INTRINSICS) == static_cast<size_t>(Intrinsic::Count));
+static_assert(static_cast<size_t>(Intrinsic::Count) <= 32, "overridden intrinsics are a 32-bit mask");
+
+// Intrinsic::Count if name isn't one
+Intrinsic FindIntrinsic(std::string_view name);
+
+// false unless args are arity numbers
+inline bool EvaluateIntrinsic(Intrinsic intrinsic, int argc, const Value* args, Value* result) {
+  int arity = INTRINSICS[static_cast<size_t>(intrinsic)].arity;
+  if (argc != arity) return false;
+
+  for (int i = 0; i < arity; ++i) {
+    if (!IsNumber(args[i])) return false;
+  }
+
+  auto a = arity > 0 ? AsNumber(args[0]) : 0;
+  auto b = arity > 1 ? AsNumber(args[1]) : 0;
+
+  switch (intrinsic) {
+    case Intrinsic::Sqrt:
+      *result = std::sqrt(a);
+      break;
+    case Intrinsic::Floor:
+      *result = std::floor(a);
+      break;
+    case Intrinsic::Ceil:
+      *result = std::ceil(a);
+      break;
+    case Intrinsic::Abs:
+      *result = std::fabs(a);
+      break;
+    case Intrinsic::Min:
+      *result = std::fmin(a, b);
+      break;
+    case Intrinsic::Max:
+      *result = std::fmax(a, b);
+      break;
+    case Intrinsic::Pow:
+      *result = std::pow(a, b);
+      break;
+    case Intrinsic::Sin:
+      *result = std::sin(a);
+      break;
+    case Intrinsic::Cos:
+      *result = std::cos(a);
+      break;
+    case Intrinsic::Exp:
+      *result = std::exp(a);
+      break;
+    case Intrinsic::Log:
+      *result = std::log(a);
+      break;
+    case Intrinsic::Clock:
+      // processor time in seconds, like clox's clock()
+      *result = static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+      break;
+    case Intrinsic::Count:
+      return false;
+  }
+  return true;
+}
+
+// defines each intrinsic as a native global as well, for calls the compiler
+// can't see (the function passed around as a value, or a rebound global)
+void RegisterMathNatives(VM* vm);
@@ -1,13 +1,28 @@
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include "chunk.h"
 #include "common.h"
+#include "program.h"
+#include "runner.h"
+#include "server.h"
+#include "snapshot.h"
+#include "stream.h"
 #include "vm.h"
 
-static void repl() {
+static void repl(VM* vm) {
   char line[1024];
   for (;;) {
     printf(">>");
@@ -16,60 +31,153 @@ static void repl() {
       printf("\n");
       break;
     }
-    VM::GetInstance()->Interpret(line);
+    vm->Interpret(line);
   }
 }
 
-static char* ReadFile(const char* path) {
-  FILE* file = fopen(path, "rb");
-  if (file == nullptr) {
+static int OpenFile(const char* path, struct stat* st) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
     fprintf(stderr, "Could not open file \"%s\".\n", path);
     exit(74);
   }
 
-  fseek(file, 0L, SEEK_END);
-
-  size_t file_size = ftell(file);
-
-  rewind(file);
-
-  char* buffer = new char[file_size + 1];
-  if (buffer == nullptr) {
-    fprintf(stderr, "Not enough memory to read \"%s\".", path);
+  if (fstat(fd, st) == -1) {
+    fprintf(stderr, "Count not read file \"%s\".", path);
     exit(74);
   }
 
-  size_t byte_read = fread(buffer, sizeof(char), file_size, file);
-  if (byte_read < file_size) {
-    fprintf(stderr, "Count not read file \"%s\".", path);
+  return fd;
+}
+
+// Maps the whole file read-only. Tokens and the compiler only point into the
+// mapping while Interpret runs; anything that outlives it is interned.
+static std::string_view MapFile(int fd, size_t file_size, const char* path) {
+  if (file_size == 0) return {};
+
+  void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Count not map file \"%s\".", path);
     exit(74);
   }
 
-  buffer[byte_read] = '\0';
+  madvise(mapping, file_size, MADV_SEQUENTIAL);
 
-  fclose(file);
-
-  return buffer;
+  return std::string_view(static_cast<const char*>(mapping), file_size);
 }
 
-static void RunFile(const char* path) {
-  char* source = ReadFile(path);
-  auto res = VM::GetInstance()->Interpret(source);
-  delete [] source;
+static void UnmapFile(std::string_view source) {
+  if (!source.empty()) munmap(const_cast<char*>(source.data()), source.size());
+}
 
+static void ExitOnError(InterpreteResult res) {
   if (res == InterpreteResult::CompilerError) exit(65);
   if (res == InterpreteResult::RuntimeError) exit(70);
 }
 
+static void RunStream(VM* vm, int fd) { ExitOnError(SourceStream(fd, vm).Run()); }
+
+static void RunFile(VM* vm, const char* path) {
+  struct stat st;
+  int fd = OpenFile(path, &st);
+
+  ScopeExit close_fd([fd]() { close(fd); });
+
+  // pipes and character devices can't be mapped
+  if (!S_ISREG(st.st_mode)) {
+    RunStream(vm, fd);
+    return;
+  }
+
+  std::string_view source = MapFile(fd, st.st_size, path);
+  auto res = vm->Interpret(source);
+  UnmapFile(source);
+
+  ExitOnError(res);
+}
+
+// cpplox -j <threads> path... runs every script in its own VM, a path given
+// more than once is compiled once and shared by its runs
+static void RunFiles(int thread_count, int count, char* paths[]) {
+  std::unordered_map<std::string_view, std::unique_ptr<CompiledProgram>> compiled;
+  std::vector<const CompiledProgram*> programs;
+
+  for (int i = 0; i < count; ++i) {
+    auto& program = compiled[paths[i]];
+    if (!program) {
+      struct stat st;
+      int fd = OpenFile(paths[i], &st);
+      std::string_view source = MapFile(fd, st.st_size, paths[i]);
+      close(fd);
+
+      program = CompiledProgram::Compile(source);
+      UnmapFile(source);
+
+      if (!program) ExitOnError(InterpreteResult::CompilerError);
+    }
+    programs.push_back(program.get());
+  }
+
+  auto results = ScriptRunner(thread_count).Run(programs);
+
+  for (auto res : results) {
+    ExitOnError(res);
+  }
+}
+
 int main(int argc, char* argv[]) {
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    RunFile(argv[1]);
+  if (argc >= 4 && strcmp(argv[1], "-j") == 0) {
+    RunFiles(std::max(1, atoi(argv[2])), argc - 3, argv + 3);
+    return 0;
+  }
+
+  const char* snapshot_in = nullptr;
+  const char* snapshot_out = nullptr;
+  const char* serve = nullptr;
+  int workers = 4;
+
+  int arg = 1;
+  for (; arg + 1 < argc; arg += 2) {
+    if (strcmp(argv[arg], "--snapshot-in") == 0) {
+      snapshot_in = argv[arg + 1];
+    } else if (strcmp(argv[arg], "--snapshot-out") == 0) {
+      snapshot_out = argv[arg + 1];
+    } else if (strcmp(argv[arg], "--serve") == 0) {
+      serve = argv[arg + 1];
+    } else if (strcmp(argv[arg], "--workers") == 0) {
+      workers = std::max(1, atoi(argv[arg + 1]));
+    } else {
+      break;
+    }
+  }
+
+  VM vm;
+
+  if (snapshot_in != nullptr && !ReadSnapshot(&vm, snapshot_in)) exit(74);
+
+  if (serve != nullptr) return Server(&vm, serve, workers).Serve();
+
+  if (argc - arg == 0) {
+    if (isatty(STDIN_FILENO)) {
+      repl(&vm);
+    } else {
+      RunStream(&vm, STDIN_FILENO);
+    }
+  } else if (argc - arg == 1) {
+    if (strcmp(argv[arg], "-") == 0) {
+      RunStream(&vm, STDIN_FILENO);
+    } else {
+      RunFile(&vm, argv[arg]);
+    }
   } else {
-    fprintf(stderr, "Usage: clox [path]\n]");
+    fprintf(stderr,
+            "Usage: clox [--snapshot-in file] [--snapshot-out file] [path]\n"
+            "       clox -j threads path...\n"
+            "       clox [--snapshot-in file] [--workers n] --serve socket\n");
     exit(64);
   }
 
+  if (snapshot_out != nullptr && !WriteSnapshot(&vm, snapshot_out)) exit(74);
+
   return 0;
 }
@@ -17,25 +17,26 @@ class Allocator {
 
 class GrabageCollector {
  public:
+  GrabageCollector(VM* vm) : vm_(vm) {}
+
   void Collect();
 
   void MarkRoots() {
-    auto vm = VM::GetInstance();
-    for (auto slot = vm->stack.begin(); slot < vm->stack_top; ++slot) {
+    for (auto slot = vm_->stack.begin(); slot < vm_->stack_top; ++slot) {
       MarkValue(*slot);
     }
 
-    for (auto& frame : vm->frames) {
-      MarkObject(frame.closure);
+    for (auto frame = vm_->frames.begin(); frame != vm_->frame_pointer_; ++frame) {
+      MarkObject(frame->closure);
     }
 
-    for (auto upvallue = vm->open_upvalues; upvallue != nullptr; upvallue = upvallue->next) {
+    for (auto upvallue : vm_->open_upvalues.slots) {
       MarkObject(upvallue);
     }
 
     MarkCompilerRoots();
 
-    MarkTable(vm->globals);
+    MarkTable(vm_->globals);
   }
 
   void MarkCompilerRoots() {}
@@ -49,7 +50,7 @@ class GrabageCollector {
   }
 
   void MarkObject(Object* obj) {
-    if (obj == nullptr) return;
+    if (obj == nullptr || obj->is_immortal) return;
     obj->is_marked = true;
 
     // debug message
@@ -63,4 +64,7 @@ class GrabageCollector {
       MarkValue(value);
     }
   }
+
+ private:
+  VM* vm_;
 };
@@ -23,7 +23,7 @@ enum class OpCode : uint8_t {
   OP_PRINT,
   OP_POP,
 
-  OP_CLOSURE,
+  OP_CLOSURE,  // function constant, then a kind byte and an index per capture
 
   OP_GET_GLOBAL,
   OP_SET_GLOBAL,
@@ -33,6 +33,7 @@ enum class OpCode : uint8_t {
 
   OP_SET_UPVALUE,
   OP_GET_UPVALUE,
+  OP_GET_CAPTURED,  // index into the closure's captured values
 
   OP_CLOSE_UPVALUE,
 
@@ -51,8 +52,33 @@ enum class OpCode : uint8_t {
 
   OP_DEFINE_GLOBAL,
   OP_CONSTANT_LONG,
+
+  OP_YIELD,
+
+  OP_INTRINSIC,  // intrinsic, name constant, argument count
+
+  OP_INDEX_GET,
+  OP_INDEX_SET,
+
+  OP_LIST,  // element count
+  OP_MAP,   // entry count, keys and values interleaved on the stack
+
+  OP_CLASS,         // name constant
+  OP_INHERIT,       // superclass, subclass
+  OP_METHOD,        // name constant; class, closure
+  OP_GET_PROPERTY,  // name constant, 16-bit cache index
+  OP_SET_PROPERTY,  // name constant, 16-bit cache index
+  OP_INVOKE,        // name constant, 16-bit cache index, argument count
+  OP_GET_SUPER,     // name constant
+  OP_SUPER_INVOKE,  // name constant, argument count
 };
 
+// flags in the kind byte of an OP_CLOSURE capture: a slot of the enclosing
+// frame rather than a capture of the enclosing closure, and a value copied
+// into the closure rather than an upvalue shared with it
+inline constexpr uint8_t kCaptureLocal = 1;
+inline constexpr uint8_t kCaptureByValue = 2;
+
 // constexpr auto operator+(OpCode a) noexcept {
 //   return static_cast<std::underlying_type_t<OpCode>>(a);
 // }
@@ -0,0 +1,289 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <initializer_list>
+#include <limits>
+
+#include "channel.h"
+
+ParallelPool::ParallelPool(VM* owner, int thread_count) {
+  // the scheduler may have shared the globals already
+  if (owner->globals_lock_ == nullptr) owner->globals_lock_ = &owner->globals_mutex_;
+
+  for (int i = 0; i < thread_count; ++i) {
+    workers_.push_back(std::make_unique<Worker>(owner, i));
+  }
+
+  for (auto& worker : workers_) {
+    worker->thread = std::thread(&ParallelPool::WorkerLoop, this, worker.get());
+  }
+}
+
+ParallelPool::~ParallelPool() {
+  {
+    std::lock_guard guard(lock_);
+    stopping_ = true;
+  }
+
+  start_.notify_all();
+
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
+}
+
+bool ParallelPool::Owns(VM* vm) const {
+  return std::any_of(workers_.begin(), workers_.end(), [vm](auto& worker) { return &worker->vm == vm; });
+}
+
+bool ParallelPool::Run(int count, const Task& task) {
+  std::lock_guard turn(run_lock_);
+
+  {
+    std::lock_guard guard(lock_);
+    task_ = &task;
+    count_ = count;
+    next_ = 0;
+    failed_ = false;
+    finished_ = 0;
+    generation_++;
+  }
+
+  start_.notify_all();
+
+  std::unique_lock guard(lock_);
+  done_.wait(guard, [this]() { return finished_ == workers_.size(); });
+
+  return !failed_;
+}
+
+void ParallelPool::WorkerLoop(Worker* worker) {
+  uint64_t seen = 0;
+
+  for (;;) {
+    {
+      std::unique_lock guard(lock_);
+      start_.wait(guard, [this, seen]() { return stopping_ || generation_ != seen; });
+      if (stopping_) return;
+      seen = generation_;
+    }
+
+    for (int index; (index = next_++) < count_;) {
+      if (!(*task_)(&worker->vm, worker->index, index)) failed_ = true;
+    }
+
+    std::lock_guard guard(lock_);
+    if (++finished_ == workers_.size()) done_.notify_one();
+  }
+}
+
+namespace {
+
+// Ranges are cut into this many slices whatever the number of threads, so
+// parallelReduce combines the same values in the same order on any machine.
+constexpr int kSlices = 64;
+
+Closure* AsClosure(Value value, int arity) {
+  if (!std::holds_alternative<Object*>(value)) return nullptr;
+
+  auto object = std::get<Object*>(value);
+  if (object->type != ObjectType::Closure) return nullptr;
+
+  auto closure = reinterpret_cast<Closure*>(object);
+  if (closure->func->arity != arity || closure->func->is_generator) return nullptr;
+
+  return closure;
+}
+
+// Each thread runs its own copy of a closure, with the captured values copied
+// when the job starts, so an assignment to one would be lost. Closures it
+// captured are checked as well.
+bool AssignsCaptured(Closure* closure, std::vector<Closure*>* checked) {
+  if (std::find(checked->begin(), checked->end(), closure) != checked->end()) return false;
+  checked->push_back(closure);
+
+  if (closure->func->assigns_captured) return true;
+
+  std::vector<Value> values(closure->Captured().begin(), closure->Captured().end());
+  for (auto upvalue : closure->Upvalues()) {
+    values.push_back(*upvalue->location);
+  }
+
+  for (auto& value : values) {
+    if (!std::holds_alternative<Object*>(value)) continue;
+
+    auto object = std::get<Object*>(value);
+    if (object->type == ObjectType::Closure && AssignsCaptured(reinterpret_cast<Closure*>(object), checked)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// A job's closures, copied into each pool VM the first time it runs a slice.
+class Shared {
+ public:
+  Shared(VM* vm, Closure* closure, const char* native) : copies_(vm->GetParallelPool()->Size()) {
+    std::vector<Closure*> checked;
+    if (AssignsCaptured(closure, &checked)) {
+      vm->RuntimeError("%s can't run a function that assigns variables it captured.", native);
+    } else if (!Message::Pack(closure, &message_)) {
+      vm->RuntimeError("%s can't share what the function captured with other threads.", native);
+    } else {
+      valid_ = true;
+    }
+  }
+
+  bool IsValid() const { return valid_; }
+
+  Closure* Get(VM* vm, int worker) {
+    auto& copy = copies_[worker];
+    if (copy == nullptr) copy = reinterpret_cast<Closure*>(std::get<Object*>(message_.Unpack(vm)));
+    return copy;
+  }
+
+ private:
+  Message message_;
+  std::vector<Closure*> copies_;
+  bool valid_{};
+};
+
+// runs closure on a pool VM, which is idle between calls
+bool CallClosure(VM* vm, Closure* closure, std::initializer_list<Value> args, Value* result) {
+  vm->ResetStack();
+  vm->Push(closure);
+  for (auto arg : args) vm->Push(arg);
+
+  if (!vm->Call(closure, args.size()) || vm->RunToCompletion() != InterpreteResult::Ok) return false;
+
+  *result = vm->return_value;
+  return true;
+}
+
+// the number of iterations of for (var i = start; i < end; i = i + 1)
+bool GetRange(VM* vm, int argc, Value* argv, const char* native, double* start, int* count) {
+  if (argc < 2 || !IsNumber(argv[0]) || !IsNumber(argv[1])) {
+    vm->RuntimeError("%s expects a start and an end number.", native);
+    return false;
+  }
+
+  if (vm->GetParallelPool()->Owns(vm)) {
+    vm->RuntimeError("%s can't be called from inside another parallel job.", native);
+    return false;
+  }
+
+  *start = AsNumber(argv[0]);
+  *count = std::clamp(std::ceil(AsNumber(argv[1]) - *start), 0.0, double(std::numeric_limits<int>::max()));
+  return true;
+}
+
+// slice of [0, count) that slice index covers
+std::pair<int, int> Slice(int count, int slices, int index) {
+  return {static_cast<int64_t>(count) * index / slices, static_cast<int64_t>(count) * (index + 1) / slices};
+}
+
+Value ParallelFor(VM* vm, int argc, Value* argv) {
+  double start;
+  int count;
+  if (!GetRange(vm, argc, argv, "parallelFor", &start, &count)) return Nil{};
+
+  auto closure = argc == 3 ? AsClosure(argv[2], 1) : nullptr;
+  if (closure == nullptr) {
+    vm->RuntimeError("parallelFor expects a function of one argument.");
+    return Nil{};
+  }
+
+  Shared fn(vm, closure, "parallelFor");
+  if (!fn.IsValid()) return Nil{};
+
+  int slices = std::min(count, kSlices);
+  bool ok = vm->GetParallelPool()->Run(slices, [&](VM* worker_vm, int worker, int index) {
+    auto copy = fn.Get(worker_vm, worker);
+    auto [begin, end] = Slice(count, slices, index);
+
+    for (int i = begin; i < end; ++i) {
+      Value ignored;
+      if (!CallClosure(worker_vm, copy, {start + i}, &ignored)) return false;
+    }
+    return true;
+  });
+
+  if (!ok) vm->RuntimeError("parallelFor stopped, a call failed.");
+  return Nil{};
+}
+
+// Each slice folds its values from the left, then the slices' results are
+// folded in order by a single thread.
+Value ParallelReduce(VM* vm, int argc, Value* argv) {
+  double start;
+  int count;
+  if (!GetRange(vm, argc, argv, "parallelReduce", &start, &count)) return Nil{};
+
+  auto fn_closure = argc == 4 ? AsClosure(argv[2], 1) : nullptr;
+  auto combine_closure = argc == 4 ? AsClosure(argv[3], 2) : nullptr;
+  if (fn_closure == nullptr || combine_closure == nullptr) {
+    vm->RuntimeError("parallelReduce expects a function of one argument and a function of two.");
+    return Nil{};
+  }
+
+  Shared fn(vm, fn_closure, "parallelReduce");
+  if (!fn.IsValid()) return Nil{};
+  Shared combine(vm, combine_closure, "parallelReduce");
+  if (!combine.IsValid()) return Nil{};
+
+  if (count == 0) return Nil{};
+
+  auto pool = vm->GetParallelPool();
+  int slices = std::min(count, kSlices);
+  std::vector<Message> partials(slices);
+
+  bool ok = pool->Run(slices, [&](VM* worker_vm, int worker, int index) {
+    auto [begin, end] = Slice(count, slices, index);
+
+    Value accumulator;
+    if (!CallClosure(worker_vm, fn.Get(worker_vm, worker), {start + begin}, &accumulator)) return false;
+
+    for (int i = begin + 1; i < end; ++i) {
+      Value value;
+      if (!CallClosure(worker_vm, fn.Get(worker_vm, worker), {start + i}, &value) ||
+          !CallClosure(worker_vm, combine.Get(worker_vm, worker), {accumulator, value}, &accumulator)) {
+        return false;
+      }
+    }
+
+    if (!Message::Pack(accumulator, &partials[index])) {
+      worker_vm->RuntimeError("parallelReduce can't return a value that belongs to its thread.");
+      return false;
+    }
+    return true;
+  });
+
+  Message result;
+  ok = ok && pool->Run(1, [&](VM* worker_vm, int worker, int index) {
+    auto accumulator = partials[0].Unpack(worker_vm);
+    for (int i = 1; i < slices; ++i) {
+      auto partial = partials[i].Unpack(worker_vm);
+      if (!CallClosure(worker_vm, combine.Get(worker_vm, worker), {accumulator, partial}, &accumulator)) return false;
+    }
+
+    if (!Message::Pack(accumulator, &result)) {
+      worker_vm->RuntimeError("parallelReduce can't return a value that belongs to its thread.");
+      return false;
+    }
+    return true;
+  });
+
+  if (!ok) {
+    vm->RuntimeError("parallelReduce stopped, a call failed.");
+    return Nil{};
+  }
+  return result.Unpack(vm);
+}
+
+}  // namespace
+
+void RegisterParallelNatives(VM* vm) {
+  vm->DefineNativeFunction("parallelFor", &ParallelFor, 3);
+  vm->DefineNativeFunction("parallelReduce", &ParallelReduce, 4);
+}
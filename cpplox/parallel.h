@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "vm.h"
+
+// Threads for parallelFor and parallelReduce, each with a worker VM of its
+// own: a heap, value stack and call frames, sharing the owner's globals. One
+// job runs at a time, split into tasks the threads take in turn.
+class ParallelPool {
+ public:
+  ParallelPool(VM* owner, int thread_count);
+
+  ~ParallelPool();
+
+  // calls task(vm, worker, index) for every index below count and returns
+  // once all have finished; false if any of them returned false
+  using Task = std::function<bool(VM* vm, int worker, int index)>;
+  bool Run(int count, const Task& task);
+
+  int Size() const { return workers_.size(); }
+
+  // true for the pool's own VMs, which can't start another job
+  bool Owns(VM* vm) const;
+
+ private:
+  struct Worker {
+    Worker(VM* owner, int index) : vm(owner), index(index) {}
+
+    VM vm;
+    int index;
+    std::thread thread;
+  };
+
+  void WorkerLoop(Worker* worker);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  // callers on different threads take turns
+  std::mutex run_lock_;
+
+  std::mutex lock_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+
+  const Task* task_{};
+  int count_{};
+  std::atomic<int> next_{};
+  std::atomic<bool> failed_{};
+  size_t finished_{};
+  uint64_t generation_{};
+  bool stopping_{};
+};
+
+// parallelFor(start, end, fn) and parallelReduce(start, end, fn, combine)
+void RegisterParallelNatives(VM* vm);
@@ -1,3 +1,5 @@
+#include <iterator>
+
 #include "compiler.h"
 #include "scanner.h"
 #include "common.h"
@@ -9,7 +11,7 @@ const Compiler::ParseRule Compiler::rules[] = {
     // [+TokenType::RightParen] = 
   {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
     // [+TokenType::LeftBrace] = 
-  {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
+  {.prefix = &Compiler::MapLiteral, .infix = nullptr, .precedence = PREC_NONE},
     // [+TokenType::RightBrace] = 
   {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
     // [+TokenType::Comma] = 
@@ -17,7 +19,7 @@ const Compiler::ParseRule Compiler::rules[] = {
     // [+TokenType::Colon] = 
   {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
     // [+TokenType::Dot] = 
-  {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
+  {.prefix = nullptr, .infix = &Compiler::Dot, .precedence = PREC_CALL},
     // [+TokenType::Minus] =
   {.prefix = &Compiler::Unary, .infix = &Compiler::Binary, .precedence = PREC_TERM},
     // [+TokenType::Plus] =
@@ -30,6 +32,10 @@ const Compiler::ParseRule Compiler::rules[] = {
   {.prefix = nullptr, .infix = &Compiler::Binary, .precedence = PREC_FACTOR},
     // [+TokenType::QuestionMark] = 
   {.prefix = nullptr, .infix = &Compiler::Ternary, .precedence = PREC_TERNARY},
+    // [+TokenType::LeftBracket] =
+  {.prefix = &Compiler::ListLiteral, .infix = &Compiler::Index, .precedence = PREC_CALL},
+    // [+TokenType::RightBracket] =
+  {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
     // [+TokenType::Bang] = 
   {.prefix = &Compiler::Unary, .infix = nullptr, .precedence = PREC_NONE},
     // [+TokenType::BangEqual] = 
@@ -75,19 +81,34 @@ const Compiler::ParseRule Compiler::rules[] = {
     // [+TokenType::Return] = 
   {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
     // [+TokenType::Super] = 
-  {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
+  {.prefix = &Compiler::Super, .infix = nullptr, .precedence = PREC_NONE},
     // [+TokenType::This] = 
-  {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
+  {.prefix = &Compiler::This, .infix = nullptr, .precedence = PREC_NONE},
     // [+TokenType::True] = 
   {.prefix = &Compiler::Literal, .infix = nullptr, .precedence = PREC_NONE},
     // [+TokenType::Var] = 
   {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
     // [+TokenType::While] = 
   {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
+    // [+TokenType::Switch] =
+  {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
+    // [+TokenType::Case] =
+  {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
+    // [+TokenType::Default] =
+  {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
+    // [+TokenType::Break] =
+  {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
+    // [+TokenType::Continue] =
+  {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
+    // [+TokenType::Yield] =
+  {.prefix = &Compiler::FiberYield, .infix = nullptr, .precedence = PREC_NONE},
     // [+TokenType::Error] = 
   {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
     // [+TokenType::Eof] = 
   {.prefix = nullptr, .infix = nullptr, .precedence = PREC_NONE},
 };
 
-const Compiler::ParseRule* Compiler::GetRule(TokenType type) { return &rules[(int)type]; }
+const Compiler::ParseRule* Compiler::GetRule(TokenType type) {
+  static_assert(std::size(rules) == +TokenType::SENTINAL, "missing parse rule");
+  return &rules[(int)type];
+}
@@ -0,0 +1,19 @@
+#include "program.h"
+
+#include "compiler.h"
+
+std::unique_ptr<CompiledProgram> CompiledProgram::Compile(std::string_view source) {
+  std::unique_ptr<CompiledProgram> program(new CompiledProgram);
+
+  Compiler compiler(source, &program->heap_);
+  program->script_.reset(compiler.Compile());
+
+  if (!program->script_) return nullptr;
+
+  program->script_->is_immortal = true;
+  for (auto object = program->heap_.objects; object != nullptr; object = object->next) {
+    object->is_immortal = true;
+  }
+
+  return program;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <memory>
+#include <string_view>
+
+#include "chunk.h"
+#include "heap.h"
+#include "value.h"
+
+// A script compiled once and shared read-only by any number of VMs, on any
+// number of threads. The program's heap holds its functions, chunks and
+// constant strings; everything created while running (closures, upvalues,
+// globals, new strings) lives in the executing VM.
+class CompiledProgram {
+ public:
+  // nullptr if the source doesn't compile
+  static std::unique_ptr<CompiledProgram> Compile(std::string_view source);
+
+  Function* GetScript() const { return script_.get(); }
+
+ private:
+  CompiledProgram() = default;
+
+  Heap heap_;
+  std::unique_ptr<Function, decltype(&Function::Free)> script_{nullptr, &Function::Free};
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+
+// Framing shared by the --serve daemon and cpplox-client. Every message is a
+// one byte kind, a 32-bit payload length in host order and the payload.
+//
+// The client sends one RunPath or RunSource frame. The server answers with
+// any number of Stdout/Stderr frames followed by a single Exit frame whose
+// payload is the 32-bit exit code cpplox would have returned.
+enum class FrameKind : uint8_t {
+  RunPath = 'P',
+  RunSource = 'S',
+  Stdout = 'O',
+  Stderr = 'E',
+  Exit = 'X',
+};
+
+inline constexpr uint32_t MAX_FRAME_SIZE = 64 * 1024 * 1024;
+
+inline bool WriteAll(int fd, const void* data, size_t size) {
+  auto bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t n = write(fd, bytes, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+inline bool ReadAll(int fd, void* data, size_t size) {
+  auto bytes = static_cast<char*>(data);
+  while (size > 0) {
+    ssize_t n = read(fd, bytes, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+inline bool WriteFrame(int fd, FrameKind kind, const void* data, uint32_t size) {
+  uint8_t header[5];
+  header[0] = static_cast<uint8_t>(kind);
+  std::copy_n(reinterpret_cast<const uint8_t*>(&size), 4, header + 1);
+  return WriteAll(fd, header, sizeof(header)) && WriteAll(fd, data, size);
+}
+
+inline bool ReadFrame(int fd, FrameKind* kind, std::vector<char>* payload) {
+  uint8_t header[5];
+  if (!ReadAll(fd, header, sizeof(header))) return false;
+
+  uint32_t size;
+  std::copy_n(header + 1, 4, reinterpret_cast<uint8_t*>(&size));
+  if (size > MAX_FRAME_SIZE) return false;
+
+  *kind = static_cast<FrameKind>(header[0]);
+  payload->resize(size);
+  return ReadAll(fd, payload->data(), size);
+}
@@ -0,0 +1,27 @@
+#include "runner.h"
+
+#include <atomic>
+#include <thread>
+
+std::vector<InterpreteResult> ScriptRunner::Run(const std::vector<const CompiledProgram*>& programs) {
+  std::vector<InterpreteResult> results(programs.size());
+  std::atomic<size_t> next{0};
+
+  auto worker = [&]() {
+    for (size_t job; (job = next.fetch_add(1, std::memory_order_relaxed)) < programs.size();) {
+      VM vm;
+      results[job] = vm.Interpret(*programs[job]);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < thread_count_; ++i) {
+    threads.emplace_back(worker);
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  return results;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <vector>
+
+#include "program.h"
+#include "vm.h"
+
+// Runs independent scripts on a pool of threads. Every run gets its own VM;
+// the same program may appear many times and is shared, not copied.
+class ScriptRunner {
+ public:
+  explicit ScriptRunner(int thread_count) : thread_count_(thread_count) {}
+
+  std::vector<InterpreteResult> Run(const std::vector<const CompiledProgram*>& programs);
+
+ private:
+  int thread_count_;
+};
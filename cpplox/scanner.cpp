@@ -1,9 +1,14 @@
 #include "scanner.h"
 
+#include <array>
+#include <charconv>
 #include <cstdio>
 #include <cstring>
+#include <string_view>
 
 #include "common.h"
+#include "heap.h"
+#include "value.h"
 
 void Scanner::SkipWhiteSpace() {
   for (;;) {
@@ -12,7 +17,9 @@ void Scanner::SkipWhiteSpace() {
     switch (c) {
       case '\n':
         line++;
-        [[fallthrough]];
+        Advance();
+        line_start = current;
+        break;
       case ' ':
         [[fallthrough]];
       case '\t':
@@ -38,8 +45,10 @@ void Scanner::SkipWhiteSpace() {
 
 Token Scanner::String() {
   while (Peek() != '"' && !IsAtEnd()) {
-    if (Peek() == '\n') line++;
-    Advance();
+    if (Advance() == '\n') {
+      line++;
+      line_start = current;
+    }
   }
 
   if (Peek() != '"') return ErrorToken("unterminate string.");
@@ -47,15 +56,24 @@ Token Scanner::String() {
   // The closing quote;
   Advance();
 
-  return MakeToken(TokenType::String);
+  Token token = MakeToken(TokenType::String);
+  token.interned = AsString(heap->AllocateString(std::string_view(token.start + 1, token.length - 2)));
+
+  return token;
 }
 
 Token Scanner::Number() {
+  // integer literals are accumulated exactly while they fit in the mantissa
+  uint64_t integer = start[0] - '0';
+  bool exact = true;
+
   while (!IsAtEnd() && IsDigit(Peek())) {
-    Advance();
+    integer = integer * 10 + (Advance() - '0');
+    if (integer >= (uint64_t{1} << 53)) exact = false;
   }
 
   if (Peek() == '.' && IsDigit(PeekNext())) {
+    exact = false;
     // consume dot
     Advance();
 
@@ -64,92 +82,84 @@ Token Scanner::Number() {
     }
   }
 
-  return MakeToken(TokenType::Number);
-}
-TokenType Scanner::CheckKeyword(int begin, int length, const char* rest, TokenType type) {
-  if (begin + length == (int)(current - start) && memcmp(rest, start + begin, length) == 0) {
-    return type;
+  Token token = MakeToken(TokenType::Number);
+  if (exact) {
+    token.number = static_cast<double>(integer);
+  } else {
+    std::from_chars(start, current, token.number);
   }
 
-  return TokenType::Identifier;
+  return token;
 }
 
-TokenType Scanner::IdentifierType() {
-  switch (*start) {
-    case 'a':
-      return CheckKeyword(1, 2, "nd", TokenType::And);
-
-    case 'b':
-      return CheckKeyword(1, 4, "reak", TokenType::Break);
-
-    case 'c': {
-      if (current - start > 1) {
-        switch (start[1]) {
-          case 'l':
-            return CheckKeyword(2, 3, "ass", TokenType::Switch);
-          case 'a':
-            return CheckKeyword(2, 2, "se", TokenType::Case);
-          case 'o':
-            return CheckKeyword(2, 6, "ntinue", TokenType::Continue);
-        }
-      }
-    }
+namespace {
+
+struct Keyword {
+  std::string_view text;
+  TokenType type;
+};
+
+constexpr Keyword kKeywords[] = {
+    {"and", TokenType::And},
+    {"break", TokenType::Break},
+    {"case", TokenType::Case},
+    {"class", TokenType::Class},
+    {"continue", TokenType::Continue},
+    {"default", TokenType::Default},
+    {"else", TokenType::Else},
+    {"false", TokenType::False},
+    {"for", TokenType::For},
+    {"fun", TokenType::Fun},
+    {"if", TokenType::If},
+    {"nil", TokenType::Nil},
+    {"or", TokenType::Or},
+    {"print", TokenType::Print},
+    {"return", TokenType::Return},
+    {"super", TokenType::Super},
+    {"switch", TokenType::Switch},
+    {"this", TokenType::This},
+    {"true", TokenType::True},
+    {"var", TokenType::Var},
+    {"while", TokenType::While},
+    {"yield", TokenType::Yield},
+};
+
+// every keyword is at least two characters long, so length and the first two
+// characters are enough to give each one its own bucket
+constexpr size_t kKeywordTableSize = 32;
+
+constexpr size_t KeywordHash(const char* text, size_t length) {
+  return (length + text[0] * 4 + text[1] * 3) & (kKeywordTableSize - 1);
+}
 
-    case 'e':
-      return CheckKeyword(1, 3, "lse", TokenType::Else);
-    case 'i':
-      return CheckKeyword(1, 1, "f", TokenType::If);
-    case 'n':
-      return CheckKeyword(1, 2, "il", TokenType::Nil);
-    case 'o':
-      return CheckKeyword(1, 1, "r", TokenType::Or);
-    case 'p':
-      return CheckKeyword(1, 4, "rint", TokenType::Print);
-    case 'r':
-      return CheckKeyword(1, 5, "eturn", TokenType::Return);
-
-    case 's': {
-      if (current - start > 1) {
-        switch (start[1]) {
-          case 'w':
-            return CheckKeyword(2, 4, "itch", TokenType::Switch);
-          case 'u':
-            return CheckKeyword(2, 3, "per", TokenType::Super);
-        }
-      }
-      break;
-    }
+constexpr auto kKeywordTable = [] {
+  std::array<Keyword, kKeywordTableSize> table{};
+  for (auto& keyword : kKeywords) {
+    table[KeywordHash(keyword.text.data(), keyword.text.size())] = keyword;
+  }
+  return table;
+}();
 
-    case 'v':
-      return CheckKeyword(1, 2, "ar", TokenType::Var);
-    case 'w':
-      return CheckKeyword(1, 4, "hile", TokenType::While);
-
-    case 'f': {
-      if (current - start > 1) {
-        switch (start[1]) {
-          case 'a':
-            return CheckKeyword(2, 3, "lse", TokenType::False);
-          case 'o':
-            return CheckKeyword(2, 1, "r", TokenType::For);
-          case 'u':
-            return CheckKeyword(2, 1, "n", TokenType::Fun);
-        }
-      }
-      break;
+constexpr bool IsPerfectHash() {
+  for (auto& keyword : kKeywords) {
+    if (kKeywordTable[KeywordHash(keyword.text.data(), keyword.text.size())].text != keyword.text) {
+      return false;
     }
+  }
+  return true;
+}
 
-    case 't': {
-      if (current - start > 1) {
-        switch (start[1]) {
-          case 'h':
-            return CheckKeyword(2, 2, "is", TokenType::This);
-          case 'r':
-            return CheckKeyword(2, 2, "ue", TokenType::True);
-        }
-      }
-      break;
-    }
+static_assert(IsPerfectHash(), "keyword hash has collisions");
+
+}  // namespace
+
+TokenType Scanner::IdentifierType() {
+  size_t length = current - start;
+  if (length < 2) return TokenType::Identifier;
+
+  auto& keyword = kKeywordTable[KeywordHash(start, length)];
+  if (keyword.text.size() == length && memcmp(keyword.text.data(), start, length) == 0) {
+    return keyword.type;
   }
 
   return TokenType::Identifier;
@@ -160,7 +170,12 @@ Token Scanner::Identifier() {
     Advance();
   }
 
-  return MakeToken(IdentifierType());
+  Token token = MakeToken(IdentifierType());
+  if (token.type == TokenType::Identifier) {
+    token.interned = AsString(heap->AllocateString(std::string_view(token.start, token.length)));
+  }
+
+  return token;
 }
 
 Token Scanner::ScanToken() {
@@ -199,6 +214,10 @@ Token Scanner::ScanToken() {
       return MakeToken(TokenType::Star);
     case '?':
       return MakeToken(TokenType::QuestionMark);
+    case '[':
+      return MakeToken(TokenType::LeftBracket);
+    case ']':
+      return MakeToken(TokenType::RightBracket);
 
     case '!':
       return match('=') ? MakeToken(TokenType::Bang) : MakeToken(TokenType::BangEqual);
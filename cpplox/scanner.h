@@ -1,6 +1,11 @@
 #pragma once
 
 #include <cstring>
+#include <string_view>
+
+struct String;
+class Heap;
+
 enum class TokenType {
   // Single-character tokens.
   LeftParen,
@@ -16,6 +21,8 @@ enum class TokenType {
   Slash,
   Star,
   QuestionMark,
+  LeftBracket,
+  RightBracket,
 
   // One or two character tokens.
   Bang,
@@ -52,6 +59,7 @@ enum class TokenType {
   Default,
   Break,
   Continue,
+  Yield,
 
   Error,
   Eof,
@@ -64,23 +72,39 @@ struct Token {
   const char* start{};
   int length{};
   int line{};
+  int column{};
+
+  // decoded at scan time, identifiers and string literals are interned so
+  // the compiler can compare names by pointer
+  String* interned{};
+  double number{};
 };
 
 class Scanner {
  public:
-  Scanner(const char* source) : start(source), current(source), line(1) {}
+  // source need not be NUL-terminated, it must outlive the scanned tokens
+  Scanner(std::string_view source, Heap* heap, int line = 1)
+      : start(source.data()),
+        current(source.data()),
+        end(source.data() + source.size()),
+        line_start(source.data()),
+        line(line),
+        heap(heap) {}
 
-  bool IsAtEnd() { return *current == '\0'; }
+  bool IsAtEnd() { return current >= end; }
 
   char Advance() {
     if (IsAtEnd()) return '\0';
     return *current++;
   }
 
-  char Peek() { return *current; }
+  char Peek() {
+    if (IsAtEnd()) return '\0';
+    return *current;
+  }
 
   char PeekNext() {
-    if (IsAtEnd()) return '\0';
+    if (current + 1 >= end) return '\0';
     return *(current + 1);
   }
 
@@ -102,9 +126,11 @@ class Scanner {
   void SkipWhiteSpace();
 
   Token MakeToken(TokenType type) {
-    return Token{.type = type, .start = start, .length = (int)(current - start), .line = line
-
-    };
+    return Token{.type = type,
+                 .start = start,
+                 .length = (int)(current - start),
+                 .line = line,
+                 .column = (int)(start - line_start) + 1};
   }
 
   Token ErrorToken(const char* message) {
@@ -113,6 +139,7 @@ class Scanner {
         .start = message,
         .length = (int)strlen(message),
         .line = line,
+        .column = (int)(start - line_start) + 1,
     };
   }
 
@@ -120,8 +147,6 @@ class Scanner {
 
   Token Number();
 
-  TokenType CheckKeyword(int start, int length, const char* rest, TokenType type);
-
   TokenType IdentifierType();
 
   Token Identifier();
@@ -130,5 +155,9 @@ class Scanner {
 
   const char* start;
   const char* current;
+  const char* end;
+  const char* line_start;
   int line;
+
+  Heap* heap;
 };
@@ -0,0 +1,280 @@
+#include "scheduler.h"
+
+#include <cstdio>
+
+#include "fiber.h"
+
+Scheduler::Scheduler(VM* owner, int thread_count) {
+  // from here on the owner's globals are shared with the workers
+  owner->globals_lock_ = &owner->globals_mutex_;
+
+  for (int i = 0; i < thread_count; ++i) {
+    workers_.push_back(std::make_unique<Worker>(owner, i));
+  }
+
+  for (auto& worker : workers_) {
+    worker->thread = std::thread(&Scheduler::WorkerLoop, this, worker.get());
+  }
+}
+
+Scheduler::~Scheduler() {
+  {
+    std::unique_lock guard(idle_lock_);
+
+    // with every worker idle and nothing queued, the remaining fibers are
+    // joining each other and will never finish
+    idle_.wait(guard, [this]() {
+      return live_ == 0 || (idle_count_ == workers_.size() && queued_ == 0 && waiting_on_io_ == 0);
+    });
+
+    if (live_ > 0) fprintf(stderr, "%d fibers never finished, they are waiting on each other.\n", live_.load());
+
+    stopping_ = true;
+  }
+
+  wake_.notify_all();
+
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
+}
+
+void Scheduler::Spawn(VM* spawner, Fiber* fiber) {
+  live_++;
+
+  for (auto& worker : workers_) {
+    if (&worker->vm == spawner) {
+      Push(worker.get(), fiber);
+      return;
+    }
+  }
+
+  Push(workers_[next_worker_++ % workers_.size()].get(), fiber);
+}
+
+Value Scheduler::Wait(Fiber* fiber) {
+  std::unique_lock guard(fiber->lock);
+  fiber->finished.wait(guard, [fiber]() { return fiber->done; });
+  return fiber->result;
+}
+
+void Scheduler::Wake(Fiber* fiber) {
+  auto worker = workers_[next_worker_++ % workers_.size()].get();
+  {
+    std::lock_guard guard(worker->lock);
+    worker->deque.push_back(fiber);
+  }
+
+  queued_++;
+
+  // the event loop's thread must be done with the scheduler once the
+  // destructor can see nothing is waiting
+  std::lock_guard guard(idle_lock_);
+  waiting_on_io_--;
+  wake_.notify_one();
+}
+
+void Scheduler::Push(Worker* worker, Fiber* fiber, bool front) {
+  {
+    std::lock_guard guard(worker->lock);
+    if (front) {
+      worker->deque.push_front(fiber);
+    } else {
+      worker->deque.push_back(fiber);
+    }
+  }
+
+  queued_++;
+
+  // taking the lock orders this with a worker about to wait
+  { std::lock_guard guard(idle_lock_); }
+  wake_.notify_one();
+}
+
+Fiber* Scheduler::Take(Worker* worker) {
+  {
+    std::lock_guard guard(worker->lock);
+    if (!worker->deque.empty()) {
+      auto fiber = worker->deque.back();
+      worker->deque.pop_back();
+      queued_--;
+      return fiber;
+    }
+  }
+
+  for (size_t i = 1; i < workers_.size(); ++i) {
+    auto victim = workers_[(worker->index + i) % workers_.size()].get();
+
+    std::lock_guard guard(victim->lock);
+    if (!victim->deque.empty()) {
+      auto fiber = victim->deque.front();
+      victim->deque.pop_front();
+      queued_--;
+      return fiber;
+    }
+  }
+
+  return nullptr;
+}
+
+void Scheduler::WorkerLoop(Worker* worker) {
+  for (;;) {
+    if (auto fiber = Take(worker)) {
+      RunFiber(worker, fiber);
+      continue;
+    }
+
+    std::unique_lock guard(idle_lock_);
+    if (stopping_) return;
+
+    idle_count_++;
+    idle_.notify_all();
+    wake_.wait(guard, [this]() { return queued_ > 0 || stopping_; });
+    idle_count_--;
+  }
+}
+
+void Scheduler::RunFiber(Worker* worker, Fiber* fiber) {
+  auto& vm = worker->vm;
+
+  bool starting = !fiber->started;
+  if (starting) {
+    fiber->started = true;
+
+    if (worker->free_stacks.empty()) {
+      fiber->stack = Stack<Value>(Fiber::STACK_SIZE);
+      fiber->frames = Stack<VM::CallFrame>(Fiber::FRAMES_SIZE);
+    } else {
+      fiber->stack = std::move(worker->free_stacks.back());
+      fiber->frames = std::move(worker->free_frames.back());
+      worker->free_stacks.pop_back();
+      worker->free_frames.pop_back();
+    }
+
+    fiber->stack_top = fiber->stack.begin();
+    fiber->frame_pointer = fiber->frames.begin();
+  }
+
+  if (fiber->io != nullptr) {
+    fiber->stack_top[-1] = fiber->io->ToValue(&vm);
+    delete fiber->io;
+    fiber->io = nullptr;
+  }
+
+  vm.SwapState(fiber);
+
+  InterpreteResult result;
+  if (starting) {
+    vm.Push(fiber->closure);
+    result = vm.Call(fiber->closure, 0) ? vm.Run() : InterpreteResult::RuntimeError;
+  } else {
+    result = vm.Run();
+  }
+
+  vm.SwapState(fiber);
+
+  if (result == InterpreteResult::Suspended) {
+    auto suspend = vm.suspend;
+    vm.suspend = VM::Suspend::None;
+
+    if (suspend == VM::Suspend::Join) {
+      Park(worker, fiber, vm.join_target);
+    } else if (suspend == VM::Suspend::Io) {
+      waiting_on_io_++;
+      fiber->io = vm.io_request;
+      fiber->io->fiber = fiber;
+      vm.GetEventLoop()->Submit(fiber->io);
+    } else {
+      // yielding or retrying, behind everything else queued here
+      Push(worker, fiber, true);
+    }
+    return;
+  }
+
+  // after a runtime error upvalues may still point into the stack, so it
+  // stays with the fiber
+  if (result == InterpreteResult::Ok) {
+    worker->free_stacks.push_back(std::move(fiber->stack));
+    worker->free_frames.push_back(std::move(fiber->frames));
+    fiber->open_upvalues = {};
+  }
+
+  Finish(worker, fiber, result == InterpreteResult::Ok ? vm.return_value : Nil{});
+}
+
+void Scheduler::Park(Worker* worker, Fiber* fiber, Fiber* target) {
+  std::unique_lock guard(target->lock);
+  if (!target->done) {
+    target->waiters.push_back(fiber);
+    return;
+  }
+
+  // finished while the fiber was being suspended
+  fiber->stack_top[-1] = target->result;
+  guard.unlock();
+
+  Push(worker, fiber);
+}
+
+void Scheduler::Finish(Worker* worker, Fiber* fiber, Value result) {
+  std::vector<Fiber*> waiters;
+  {
+    std::lock_guard guard(fiber->lock);
+    fiber->done = true;
+    fiber->result = result;
+    waiters.swap(fiber->waiters);
+  }
+  fiber->finished.notify_all();
+
+  // each waiter is suspended in join(), whose result is the top of its stack
+  for (auto waiter : waiters) {
+    waiter->stack_top[-1] = result;
+    Push(worker, waiter);
+  }
+
+  if (--live_ == 0) {
+    std::lock_guard guard(idle_lock_);
+    idle_.notify_all();
+  }
+}
+
+static bool IsObjectType(Value value, ObjectType type) {
+  return std::holds_alternative<Object*>(value) && std::get<Object*>(value)->type == type;
+}
+
+static Value Spawn(VM* vm, int argc, Value* argv) {
+  if (argc != 1 || !IsObjectType(argv[0], ObjectType::Closure)) return Nil{};
+
+  auto fiber = new Fiber(reinterpret_cast<Closure*>(std::get<Object*>(argv[0])));
+  vm->InsertObject(fiber);
+
+  vm->GetScheduler()->Spawn(vm, fiber);
+
+  return fiber;
+}
+
+static Value Yield(VM* vm, int argc, Value* argv) {
+  vm->suspend = VM::Suspend::Yield;
+  return Nil{};
+}
+
+static Value Join(VM* vm, int argc, Value* argv) {
+  if (argc != 1 || !IsObjectType(argv[0], ObjectType::Fiber)) return Nil{};
+
+  auto fiber = reinterpret_cast<Fiber*>(std::get<Object*>(argv[0]));
+  {
+    std::lock_guard guard(fiber->lock);
+    if (fiber->done) return fiber->result;
+  }
+
+  // the caller is suspended and resumed with the fiber's result
+  vm->suspend = VM::Suspend::Join;
+  vm->join_target = fiber;
+  return Nil{};
+}
+
+void RegisterFiberNatives(VM* vm) {
+  vm->DefineNativeFunction("spawn", &Spawn, 1);
+  vm->DefineNativeFunction("yield", &Yield, 0);
+  vm->DefineNativeFunction("join", &Join, 1);
+}
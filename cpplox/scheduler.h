@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "vm.h"
+
+// Runs the fibers spawned by one VM on a pool of threads. Each thread owns a
+// worker VM and a deque of runnable fibers: it takes the newest fiber from
+// its own deque and, when that is empty, steals the oldest from another.
+class Scheduler {
+ public:
+  Scheduler(VM* owner, int thread_count);
+
+  // waits for every spawned fiber to finish, then stops the threads
+  ~Scheduler();
+
+  // queues a new fiber, on spawner's thread if spawner is a worker
+  void Spawn(VM* spawner, Fiber* fiber);
+
+  // blocks a thread that isn't running fibers until fiber is done
+  Value Wait(Fiber* fiber);
+
+  // requeues a fiber whose I/O has completed
+  void Wake(Fiber* fiber);
+
+ private:
+  struct Worker {
+    Worker(VM* owner, int index) : vm(owner), index(index) {}
+
+    VM vm;
+    int index;
+
+    std::mutex lock;
+    std::deque<Fiber*> deque;
+
+    // stacks of fibers that finished here, reused by the next one to start
+    std::vector<Stack<Value>> free_stacks;
+    std::vector<Stack<VM::CallFrame>> free_frames;
+
+    std::thread thread;
+  };
+
+  void Push(Worker* worker, Fiber* fiber, bool front = false);
+
+  Fiber* Take(Worker* worker);
+
+  void WorkerLoop(Worker* worker);
+
+  void RunFiber(Worker* worker, Fiber* fiber);
+
+  void Park(Worker* worker, Fiber* fiber, Fiber* target);
+
+  void Finish(Worker* worker, Fiber* fiber, Value result);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  std::atomic<int> queued_{};
+  std::atomic<int> live_{};
+  // parked until the event loop wakes them
+  std::atomic<int> waiting_on_io_{};
+  std::atomic<size_t> next_worker_{};
+
+  std::mutex idle_lock_;
+  std::condition_variable wake_;
+  std::condition_variable idle_;
+  size_t idle_count_{};
+  bool stopping_{};
+};
+
+// spawn(fn), yield() and join(fiber)
+void RegisterFiberNatives(VM* vm);
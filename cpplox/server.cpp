@@ -0,0 +1,198 @@
+#include "server.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+
+#include "protocol.h"
+#include "stream.h"
+
+static volatile sig_atomic_t stopping = 0;
+
+static void Stop(int) { stopping = 1; }
+
+static int ExitCode(InterpreteResult result) {
+  switch (result) {
+    case InterpreteResult::Ok:
+      return 0;
+    case InterpreteResult::CompilerError:
+      return 65;
+    case InterpreteResult::RuntimeError:
+    case InterpreteResult::Suspended:
+      return 70;
+  }
+  return 70;
+}
+
+int Server::Serve() {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path_) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path \"%s\" is too long.\n", socket_path_);
+    return 64;
+  }
+  strcpy(addr.sun_path, socket_path_);
+
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path_);
+  if (listen_fd_ == -1 || bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+      listen(listen_fd_, SOMAXCONN) == -1) {
+    fprintf(stderr, "Could not listen on \"%s\": %s\n", socket_path_, strerror(errno));
+    return 74;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  // no SA_RESTART, so waitpid below wakes up to notice the flag
+  struct sigaction action {};
+  action.sa_handler = Stop;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  // anything still buffered would otherwise be written once per child
+  fflush(stdout);
+  fflush(stderr);
+
+  for (int i = 0; i < worker_count_; ++i) {
+    workers_.push_back(SpawnWorker());
+  }
+
+  while (!stopping) {
+    pid_t pid = waitpid(-1, nullptr, 0);
+    if (pid == -1) continue;
+
+    // keep the pool full if a worker dies
+    auto worker = std::find(workers_.begin(), workers_.end(), pid);
+    if (worker != workers_.end() && !stopping) *worker = SpawnWorker();
+  }
+
+  for (auto pid : workers_) {
+    kill(pid, SIGTERM);
+  }
+  for (auto pid : workers_) {
+    waitpid(pid, nullptr, 0);
+  }
+
+  close(listen_fd_);
+  unlink(socket_path_);
+
+  return 0;
+}
+
+pid_t Server::SpawnWorker() {
+  pid_t pid = fork();
+  if (pid == 0) WorkerLoop();
+  return pid;
+}
+
+void Server::WorkerLoop() {
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  for (;;) {
+    int conn = accept(listen_fd_, nullptr, nullptr);
+    if (conn == -1) continue;
+
+    HandleConnection(conn);
+    close(conn);
+  }
+}
+
+void Server::HandleConnection(int conn) {
+  FrameKind kind;
+  std::vector<char> request;
+  if (!ReadFrame(conn, &kind, &request)) return;
+  if (kind != FrameKind::RunPath && kind != FrameKind::RunSource) return;
+
+  int out[2], err[2];
+  if (pipe(out) == -1) return;
+  if (pipe(err) == -1) {
+    close(out[0]);
+    close(out[1]);
+    return;
+  }
+
+  pid_t child = fork();
+  if (child == 0) {
+    close(conn);
+    close(listen_fd_);
+    close(out[0]);
+    close(err[0]);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    close(out[1]);
+    close(err[1]);
+
+    int code;
+    if (kind == FrameKind::RunSource) {
+      code = ExitCode(vm_->Interpret(std::string_view(request.data(), request.size())));
+    } else {
+      request.push_back('\0');
+      int fd = open(request.data(), O_RDONLY);
+      if (fd == -1) {
+        fprintf(stderr, "Could not open file \"%s\".\n", request.data());
+        code = 74;
+      } else {
+        code = ExitCode(SourceStream(fd, vm_).Run());
+      }
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    _exit(code);
+  }
+
+  close(out[1]);
+  close(err[1]);
+
+  if (child != -1) ForwardOutput(conn, out[0], err[0]);
+
+  close(out[0]);
+  close(err[0]);
+
+  int status = 0;
+  if (child != -1) waitpid(child, &status, 0);
+
+  uint32_t code = child != -1 && WIFEXITED(status) ? WEXITSTATUS(status) : 70;
+  WriteFrame(conn, FrameKind::Exit, &code, sizeof(code));
+}
+
+void Server::ForwardOutput(int conn, int out_fd, int err_fd) {
+  pollfd fds[2] = {{out_fd, POLLIN, 0}, {err_fd, POLLIN, 0}};
+  const FrameKind kinds[2] = {FrameKind::Stdout, FrameKind::Stderr};
+  int open_count = 2;
+  // once the client is gone output is still drained so the child can finish
+  bool connected = true;
+
+  char buffer[64 * 1024];
+  while (open_count > 0) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      return;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+      if (fds[i].fd == -1 || fds[i].revents == 0) continue;
+
+      ssize_t n = read(fds[i].fd, buffer, sizeof(buffer));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        fds[i].fd = -1;
+        open_count--;
+        continue;
+      }
+
+      if (connected) connected = WriteFrame(conn, kinds[i], buffer, n);
+    }
+  }
+}
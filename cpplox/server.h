@@ -0,0 +1,36 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <vector>
+
+#include "vm.h"
+
+// cpplox --serve <socket> keeps a warmed VM (natives registered, snapshot
+// loaded) and pre-forks a pool of workers that accept requests on a Unix
+// domain socket. Each request runs in a fork of its worker, so it starts from
+// the warm heap copy-on-write and leaves nothing behind for the next one.
+class Server {
+ public:
+  Server(VM* vm, const char* socket_path, int worker_count)
+      : vm_(vm), socket_path_(socket_path), worker_count_(worker_count) {}
+
+  // Runs until SIGINT or SIGTERM, returns the process exit code.
+  int Serve();
+
+ private:
+  pid_t SpawnWorker();
+
+  [[noreturn]] void WorkerLoop();
+
+  void HandleConnection(int conn);
+
+  // forwards the request's output as frames until both pipes are closed
+  void ForwardOutput(int conn, int out_fd, int err_fd);
+
+  VM* vm_;
+  const char* socket_path_;
+  int worker_count_;
+  int listen_fd_{-1};
+  std::vector<pid_t> workers_;
+};
@@ -0,0 +1,696 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "chunk.h"
+#include "class.h"
+#include "collection.h"
+#include "common.h"
+#include "float64_array.h"
+#include "value.h"
+
+namespace {
+
+constexpr char kMagic[8] = {'L', 'O', 'X', 'S', 'N', 'A', 'P', '\0'};
+constexpr uint32_t kVersion = 10;
+constexpr uint32_t kNoObject = UINT32_MAX;
+
+// Records are written grouped by type in this order, so a closure's function
+// and upvalues, an instance's class and a bound method's closure always
+// precede it. Only references held in Values can point
+// forward and need fixing up after everything is allocated.
+constexpr ObjectType kRecordOrder[] = {
+    ObjectType::String, ObjectType::Float64Array, ObjectType::Function, ObjectType::NativeFunction,
+    ObjectType::Upvalue, ObjectType::Closure, ObjectType::Class, ObjectType::Instance,
+    ObjectType::BoundMethod, ObjectType::List, ObjectType::Map,
+};
+
+enum class ValueTag : uint8_t { Nil, Bool, Number, Object };
+
+// what a snapshot can't hold, described for the error, nullptr if it can
+const char* UnsavedKind(ObjectType type) {
+  switch (type) {
+    case ObjectType::Fiber:
+      return "a fiber";
+    case ObjectType::Generator:
+      return "a generator";
+    // channels aren't on any heap, and the messages in them aren't either
+    case ObjectType::Channel:
+      return "a channel";
+    default:
+      return nullptr;
+  }
+}
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t object_count;
+  uint32_t global_count;
+};
+
+class SnapshotWriter {
+ public:
+  explicit SnapshotWriter(VM* vm) : vm_(vm) {}
+
+  bool Write(const char* path);
+
+ private:
+  template <typename T>
+  void Put(T value) {
+    auto bytes = reinterpret_cast<const uint8_t*>(&value);
+    out_.insert(out_.end(), bytes, bytes + sizeof(T));
+  }
+
+  void PutBytes(const void* data, size_t size) {
+    auto bytes = static_cast<const uint8_t*>(data);
+    out_.insert(out_.end(), bytes, bytes + size);
+  }
+
+  void PutObject(Object* object);
+
+  void PutValue(Value value);
+
+  void PutRecord(Object* object);
+
+  VM* vm_;
+  std::unordered_map<Object*, uint32_t> indices_;
+  std::vector<uint8_t> out_;
+  bool ok_{true};
+  // set when the failure is a reference to something UnsavedKind names
+  const char* unsaved_{};
+};
+
+void SnapshotWriter::PutObject(Object* object) {
+  if (object == nullptr) {
+    Put(kNoObject);
+    return;
+  }
+
+  auto iter = indices_.find(object);
+  if (iter == indices_.end()) {
+    // only objects on the VM's own list can be written
+    ok_ = false;
+    if (auto kind = UnsavedKind(object->type)) unsaved_ = kind;
+    Put(kNoObject);
+    return;
+  }
+
+  Put(iter->second);
+}
+
+void SnapshotWriter::PutValue(Value value) {
+  if (IsNil(value)) {
+    Put(ValueTag::Nil);
+  } else if (std::holds_alternative<bool>(value)) {
+    Put(ValueTag::Bool);
+    Put<uint8_t>(std::get<bool>(value));
+  } else if (IsNumber(value)) {
+    Put(ValueTag::Number);
+    Put(AsNumber(value));
+  } else {
+    Put(ValueTag::Object);
+    PutObject(std::get<Object*>(value));
+  }
+}
+
+void SnapshotWriter::PutRecord(Object* object) {
+  Put(object->type);
+
+  switch (object->type) {
+    case ObjectType::String: {
+      auto string = reinterpret_cast<String*>(object);
+      Put<uint32_t>(string->length);
+      PutBytes(string->content, string->length);
+      break;
+    }
+
+    case ObjectType::Float64Array: {
+      auto array = reinterpret_cast<Float64Array*>(object);
+      Put<uint64_t>(array->length);
+      PutBytes(array->data, array->length * sizeof(double));
+      break;
+    }
+
+    case ObjectType::List: {
+      auto list = reinterpret_cast<List*>(object);
+      Put<uint32_t>(list->values.size());
+      for (auto value : list->values) {
+        PutValue(value);
+      }
+      break;
+    }
+
+    case ObjectType::Map: {
+      auto map = reinterpret_cast<Map*>(object);
+      Put<uint32_t>(map->table.Size());
+      map->table.ForEach([this](const HashTable::Entry& entry) {
+        PutValue(entry.key);
+        PutValue(entry.value);
+      });
+      break;
+    }
+
+    case ObjectType::Function: {
+      auto function = reinterpret_cast<Function*>(object);
+
+      // the code size first, a function is allocated with room for its code
+      Put<uint32_t>(function->code_size);
+      Put<uint32_t>(function->arity);
+      Put<uint32_t>(function->upvalue_count);
+      Put<uint32_t>(function->captured_count);
+      Put<uint32_t>(function->lifted_count);
+      Put<uint8_t>(function->is_generator);
+      Put<uint8_t>(function->assigns_captured);
+      Put<uint32_t>(function->cache_count);
+      PutObject(function->info->name);
+
+      PutBytes(function->code, function->code_size);
+
+      Put<uint32_t>(function->constants.size());
+      for (auto& constant : function->constants) {
+        PutValue(constant);
+      }
+
+      // positions as runs, re-appended on load
+      std::vector<std::pair<LineInfo::Position, uint32_t>> runs;
+      for (int offset = 0; offset < function->code_size; ++offset) {
+        auto position = function->info->line_info.GetPosition(offset);
+        if (!runs.empty() && runs.back().first.line == position.line &&
+            runs.back().first.column == position.column) {
+          runs.back().second++;
+        } else {
+          runs.push_back({position, 1});
+        }
+      }
+
+      Put<uint32_t>(runs.size());
+      for (auto& [position, count] : runs) {
+        Put<int32_t>(position.line);
+        Put<int32_t>(position.column);
+        Put<uint32_t>(count);
+      }
+      break;
+    }
+
+    case ObjectType::NativeFunction:
+      PutObject(reinterpret_cast<NativeFunction*>(object)->name);
+      break;
+
+    case ObjectType::Upvalue:
+      // the script has finished, so every upvalue is written closed
+      PutValue(*reinterpret_cast<Upvalue*>(object)->location);
+      break;
+
+    case ObjectType::Closure: {
+      auto closure = reinterpret_cast<Closure*>(object);
+      PutObject(closure->func);
+      Put<uint32_t>(closure->upvalue_count);
+      for (auto upvalue : closure->Upvalues()) {
+        PutObject(upvalue);
+      }
+      for (auto& value : closure->Captured()) {
+        PutValue(value);
+      }
+      break;
+    }
+
+    case ObjectType::Class: {
+      auto klass = reinterpret_cast<Class*>(object);
+      PutObject(klass->name);
+      Put<uint32_t>(klass->methods.size());
+      for (auto& [hash, method] : klass->methods) {
+        Put<uint64_t>(hash);
+        PutValue(method);
+      }
+      PutValue(klass->initializer);
+      break;
+    }
+
+    case ObjectType::Instance: {
+      // fields by name in slot order, the shape is rebuilt by adding them again
+      auto instance = reinterpret_cast<Instance*>(object);
+      PutObject(instance->shape->klass);
+      Put<uint32_t>(instance->fields.size());
+      std::vector<String*> names(instance->fields.size());
+      for (auto shape = instance->shape; shape->parent != nullptr; shape = shape->parent) {
+        names[shape->size - 1] = shape->name;
+      }
+      for (size_t i = 0; i < names.size(); ++i) {
+        PutObject(names[i]);
+        PutValue(instance->fields[i]);
+      }
+      break;
+    }
+
+    case ObjectType::BoundMethod: {
+      auto bound = reinterpret_cast<BoundMethod*>(object);
+      PutValue(bound->receiver);
+      PutObject(bound->method);
+      break;
+    }
+
+    // never in kRecordOrder, PutObject fails on references to these
+    case ObjectType::Fiber:
+    case ObjectType::Generator:
+    case ObjectType::Channel:
+      break;
+  }
+}
+
+bool SnapshotWriter::Write(const char* path) {
+  std::vector<Object*> records;
+  for (auto type : kRecordOrder) {
+    for (auto object = vm_->objects; object != nullptr; object = object->next) {
+      if (object->type != type) continue;
+      indices_[object] = records.size();
+      records.push_back(object);
+    }
+  }
+
+  Header header{};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.object_count = records.size();
+  header.global_count = vm_->globals.size();
+  Put(header);
+
+  for (auto object : records) {
+    PutRecord(object);
+  }
+
+  for (auto& [hash, value] : vm_->globals) {
+    Put<uint64_t>(hash);
+    PutValue(value);
+  }
+
+  if (unsaved_ != nullptr) {
+    fprintf(stderr, "Could not snapshot: the heap references %s, which can't be saved.\n", unsaved_);
+    return false;
+  }
+
+  if (!ok_) {
+    fprintf(stderr, "Could not snapshot: heap references an object the VM doesn't own.\n");
+    return false;
+  }
+
+  FILE* file = fopen(path, "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "Could not open snapshot \"%s\".\n", path);
+    return false;
+  }
+
+  ScopeExit close_file([file]() { fclose(file); });
+
+  if (fwrite(out_.data(), 1, out_.size(), file) != out_.size()) {
+    fprintf(stderr, "Could not write snapshot \"%s\".\n", path);
+    return false;
+  }
+
+  return true;
+}
+
+class SnapshotReader {
+ public:
+  SnapshotReader(VM* vm, const uint8_t* data, size_t size) : vm_(vm), in_(data), end_(data + size) {}
+
+  bool Read();
+
+ private:
+  template <typename T>
+  bool Get(T* value) {
+    if (end_ - in_ < (ptrdiff_t)sizeof(T)) return false;
+    memcpy(value, in_, sizeof(T));
+    in_ += sizeof(T);
+    return true;
+  }
+
+  // resolves an index to an object that has already been read
+  template <typename T>
+  bool GetObject(T** object, ObjectType type);
+
+  // object references are recorded and patched once every object exists
+  bool GetValue(Value* value);
+
+  bool GetRecord();
+
+  struct Fixup {
+    Value* value;
+    uint32_t index;
+  };
+
+  // a map's entries can only be hashed once their keys are fixed up
+  struct PendingMap {
+    Map* map;
+    std::vector<HashTable::Entry> entries;
+  };
+
+  VM* vm_;
+  const uint8_t* in_;
+  const uint8_t* end_;
+
+  std::vector<Object*> objects_;
+  std::vector<Fixup> fixups_;
+  std::vector<PendingMap> pending_maps_;
+};
+
+template <typename T>
+bool SnapshotReader::GetObject(T** object, ObjectType type) {
+  uint32_t index;
+  if (!Get(&index)) return false;
+
+  if (index == kNoObject) {
+    *object = nullptr;
+    return true;
+  }
+
+  if (index >= objects_.size() || objects_[index]->type != type) return false;
+
+  *object = reinterpret_cast<T*>(objects_[index]);
+  return true;
+}
+
+bool SnapshotReader::GetValue(Value* value) {
+  ValueTag tag;
+  if (!Get(&tag)) return false;
+
+  switch (tag) {
+    case ValueTag::Nil:
+      *value = Nil{};
+      return true;
+
+    case ValueTag::Bool: {
+      uint8_t b;
+      if (!Get(&b)) return false;
+      *value = b != 0;
+      return true;
+    }
+
+    case ValueTag::Number: {
+      double d;
+      if (!Get(&d)) return false;
+      *value = d;
+      return true;
+    }
+
+    case ValueTag::Object: {
+      uint32_t index;
+      if (!Get(&index)) return false;
+      fixups_.push_back({value, index});
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool SnapshotReader::GetRecord() {
+  ObjectType type;
+  if (!Get(&type)) return false;
+
+  switch (type) {
+    case ObjectType::String: {
+      uint32_t length;
+      if (!Get(&length) || end_ - in_ < length) return false;
+
+      objects_.push_back(std::get<Object*>(
+          vm_->AllocateString(std::string_view(reinterpret_cast<const char*>(in_), length))));
+      in_ += length;
+      return true;
+    }
+
+    case ObjectType::Float64Array: {
+      uint64_t length;
+      if (!Get(&length) || (end_ - in_) / sizeof(double) < length) return false;
+
+      auto array = new Float64Array(length);
+      vm_->InsertObject(array);
+      objects_.push_back(array);
+
+      memcpy(array->data, in_, length * sizeof(double));
+      in_ += length * sizeof(double);
+      return true;
+    }
+
+    case ObjectType::Function: {
+      uint32_t code_size, arity, upvalue_count, captured_count, lifted_count, cache_count;
+      uint32_t constant_count, run_count;
+      uint8_t is_generator, assigns_captured;
+
+      if (!Get(&code_size) || end_ - in_ < code_size) return false;
+
+      auto function = Function::New(code_size);
+      vm_->InsertObject(function);
+      objects_.push_back(function);
+
+      if (!Get(&arity) || !Get(&upvalue_count) || !Get(&captured_count) || !Get(&lifted_count) ||
+          !Get(&is_generator) || !Get(&assigns_captured) || !Get(&cache_count)) {
+        return false;
+      }
+      function->arity = arity;
+      function->upvalue_count = upvalue_count;
+      function->captured_count = captured_count;
+      function->lifted_count = lifted_count;
+      function->is_generator = is_generator;
+      function->assigns_captured = assigns_captured;
+      function->cache_count = cache_count;
+
+      if (!GetObject(&function->info->name, ObjectType::String)) return false;
+
+      if (end_ - in_ < code_size) return false;
+      memcpy(function->code, in_, code_size);
+      in_ += code_size;
+
+      // sized up front so fixups can point into it
+      if (!Get(&constant_count)) return false;
+      function->constants.resize(constant_count);
+      for (auto& constant : function->constants) {
+        if (!GetValue(&constant)) return false;
+      }
+
+      if (!Get(&run_count)) return false;
+      for (uint32_t i = 0; i < run_count; ++i) {
+        int32_t line, column;
+        uint32_t count;
+        if (!Get(&line) || !Get(&column) || !Get(&count)) return false;
+        while (count-- > 0) function->info->line_info.Append(line, column);
+      }
+      return true;
+    }
+
+    case ObjectType::NativeFunction: {
+      String* name;
+      if (!GetObject(&name, ObjectType::String) || name == nullptr) return false;
+
+      // re-bind to the native this VM registered under the same name
+      auto iter = vm_->globals.find(name->hash);
+      if (iter == vm_->globals.end() || !std::holds_alternative<Object*>(iter->second) ||
+          std::get<Object*>(iter->second)->type != ObjectType::NativeFunction) {
+        fprintf(stderr, "Snapshot needs native function '%s'.\n", name->GetCString());
+        return false;
+      }
+
+      objects_.push_back(std::get<Object*>(iter->second));
+      return true;
+    }
+
+    case ObjectType::Upvalue: {
+      auto upvalue = new Upvalue(nullptr);
+      upvalue->location = &upvalue->closed;
+      vm_->InsertObject(upvalue);
+      objects_.push_back(upvalue);
+
+      return GetValue(&upvalue->closed);
+    }
+
+    case ObjectType::Closure: {
+      Function* function;
+      uint32_t upvalue_count;
+      if (!GetObject(&function, ObjectType::Function) || function == nullptr) return false;
+      if (!Get(&upvalue_count) || upvalue_count != function->upvalue_count) return false;
+
+      auto closure = Closure::New(function);
+      vm_->InsertObject(closure);
+      objects_.push_back(closure);
+
+      for (auto& upvalue : closure->Upvalues()) {
+        if (!GetObject(&upvalue, ObjectType::Upvalue)) return false;
+      }
+      // sized by the function, so fixups can point into it
+      for (auto& value : closure->Captured()) {
+        if (!GetValue(&value)) return false;
+      }
+      return true;
+    }
+
+    case ObjectType::Class: {
+      String* name;
+      uint32_t method_count;
+      if (!GetObject(&name, ObjectType::String) || name == nullptr || !Get(&method_count)) return false;
+
+      auto klass = new Class(name);
+      vm_->InsertObject(klass);
+      objects_.push_back(klass);
+
+      // map nodes are stable, so fixups can point at the methods
+      for (uint32_t i = 0; i < method_count; ++i) {
+        uint64_t hash;
+        if (!Get(&hash) || !GetValue(&klass->methods[hash])) return false;
+      }
+      return GetValue(&klass->initializer);
+    }
+
+    case ObjectType::Instance: {
+      Class* klass;
+      uint32_t field_count;
+      if (!GetObject(&klass, ObjectType::Class) || klass == nullptr || !Get(&field_count)) return false;
+
+      auto instance = new Instance(klass);
+      vm_->InsertObject(instance);
+      objects_.push_back(instance);
+
+      instance->fields.resize(field_count);
+      for (auto& field : instance->fields) {
+        String* name;
+        if (!GetObject(&name, ObjectType::String) || name == nullptr) return false;
+
+        auto property = klass->Lookup(instance->shape, name);
+        if (property->slot != -1) return false;
+        instance->shape = klass->Transition(property, name);
+
+        if (!GetValue(&field)) return false;
+      }
+      return true;
+    }
+
+    case ObjectType::BoundMethod: {
+      auto bound = new BoundMethod(Nil{}, nullptr);
+      vm_->InsertObject(bound);
+      objects_.push_back(bound);
+
+      if (!GetValue(&bound->receiver)) return false;
+      return GetObject(&bound->method, ObjectType::Closure) && bound->method != nullptr;
+    }
+
+    case ObjectType::List: {
+      uint32_t size;
+      if (!Get(&size)) return false;
+
+      auto list = new List;
+      vm_->InsertObject(list);
+      objects_.push_back(list);
+
+      // sized up front so fixups can point into it
+      list->values.resize(size);
+      for (auto& value : list->values) {
+        if (!GetValue(&value)) return false;
+      }
+      return true;
+    }
+
+    case ObjectType::Map: {
+      uint32_t size;
+      if (!Get(&size)) return false;
+
+      auto map = new Map;
+      vm_->InsertObject(map);
+      objects_.push_back(map);
+
+      // moving the pending maps keeps each one's entries where they are
+      auto& pending = pending_maps_.emplace_back(PendingMap{map, std::vector<HashTable::Entry>(size)});
+      for (auto& entry : pending.entries) {
+        if (!GetValue(&entry.key) || !GetValue(&entry.value)) return false;
+      }
+      return true;
+    }
+
+    case ObjectType::Fiber:
+    case ObjectType::Generator:
+    case ObjectType::Channel:
+      return false;
+  }
+
+  return false;
+}
+
+bool SnapshotReader::Read() {
+  Header header;
+  if (!Get(&header) || memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion) {
+    return false;
+  }
+
+  objects_.reserve(header.object_count);
+  for (uint32_t i = 0; i < header.object_count; ++i) {
+    if (!GetRecord()) return false;
+  }
+
+  for (uint32_t i = 0; i < header.global_count; ++i) {
+    uint64_t hash;
+    if (!Get(&hash)) return false;
+
+    // map nodes are stable, so the fixup can point at the global itself
+    auto& global = vm_->globals[hash];
+    if (!GetValue(&global)) return false;
+  }
+
+  for (auto& fixup : fixups_) {
+    if (fixup.index >= objects_.size()) return false;
+    *fixup.value = objects_[fixup.index];
+  }
+
+  for (auto& [map, entries] : pending_maps_) {
+    for (auto& entry : entries) {
+      map->table.Insert(entry.key, entry.value);
+    }
+  }
+
+  return in_ == end_;
+}
+
+}  // namespace
+
+bool WriteSnapshot(VM* vm, const char* path) { return SnapshotWriter(vm).Write(path); }
+
+bool ReadSnapshot(VM* vm, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Could not open snapshot \"%s\".\n", path);
+    return false;
+  }
+
+  ScopeExit close_fd([fd]() { close(fd); });
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    fprintf(stderr, "Could not read snapshot \"%s\".\n", path);
+    return false;
+  }
+
+  void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Could not map snapshot \"%s\".\n", path);
+    return false;
+  }
+
+  ScopeExit unmap([mapping, &st]() { munmap(mapping, st.st_size); });
+
+  madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+  if (!SnapshotReader(vm, static_cast<const uint8_t*>(mapping), st.st_size).Read()) {
+    fprintf(stderr, "Snapshot \"%s\" is corrupt or from another build.\n", path);
+    return false;
+  }
+
+  vm->RefreshIntrinsics();
+
+  return true;
+}
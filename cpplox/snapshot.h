@@ -0,0 +1,16 @@
+#pragma once
+
+#include "vm.h"
+
+// A snapshot is a VM's object list and globals written out after a script has
+// run, so later processes can start from the initialized heap instead of
+// re-running the script. Object references are stored as indices into the
+// snapshot's object table, so the file doesn't depend on where anything was
+// allocated. Native functions are stored by name and re-bound on load to the
+// natives the loading VM registered.
+
+bool WriteSnapshot(VM* vm, const char* path);
+
+// Loads into a freshly constructed VM. Returns false, after printing why, if
+// the file can't be read or wasn't written by this build.
+bool ReadSnapshot(VM* vm, const char* path);
@@ -0,0 +1,88 @@
+#include "stack.h"
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <new>
+#include <utility>
+
+namespace {
+
+thread_local OverflowTrap* current_trap;
+
+struct sigaction previous_segv;
+struct sigaction previous_bus;
+
+void OnFault(int signal, siginfo_t* info, void* context) {
+  if (auto trap = current_trap; trap != nullptr) {
+    for (auto region : trap->regions) {
+      if (region->InGuard(info->si_addr)) siglongjmp(trap->env, 1);
+    }
+  }
+
+  // not an overflow, so the faulting instruction runs again with the handler
+  // that was there before
+  sigaction(signal, signal == SIGSEGV ? &previous_segv : &previous_bus, nullptr);
+}
+
+// SA_NODEFER leaves the signal unblocked after the jump, so entering a trap
+// doesn't have to save the signal mask
+void InstallFaultHandler() {
+  struct sigaction action {};
+  action.sa_sigaction = &OnFault;
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+
+  sigaction(SIGSEGV, &action, &previous_segv);
+  // some systems report touching a PROT_NONE page as a bus error
+  sigaction(SIGBUS, &action, &previous_bus);
+}
+
+size_t PageSize() {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+}  // namespace
+
+StackRegion::StackRegion(size_t bytes) {
+  static std::once_flag handler_installed;
+  std::call_once(handler_installed, &InstallFaultHandler);
+
+  auto page = PageSize();
+  size_ = (bytes + page - 1) / page * page;
+
+  void* mapping =
+      mmap(nullptr, size_ + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapping == MAP_FAILED) throw std::bad_alloc();
+
+  base_ = static_cast<char*>(mapping);
+  mprotect(base_ + size_, page, PROT_NONE);
+}
+
+StackRegion::~StackRegion() {
+  if (base_ != nullptr) munmap(base_, size_ + PageSize());
+}
+
+StackRegion::StackRegion(StackRegion&& other) noexcept
+    : base_(std::exchange(other.base_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+StackRegion& StackRegion::operator=(StackRegion&& other) noexcept {
+  std::swap(base_, other.base_);
+  std::swap(size_, other.size_);
+  return *this;
+}
+
+bool StackRegion::InGuard(const void* address) const {
+  auto byte = static_cast<const char*>(address);
+  return base_ != nullptr && byte >= base_ + size_ && byte < base_ + size_ + PageSize();
+}
+
+void EnterOverflowTrap(OverflowTrap* trap) {
+  trap->enclosing = current_trap;
+  current_trap = trap;
+}
+
+void LeaveOverflowTrap(OverflowTrap* trap) { current_trap = trap->enclosing; }
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <csetjmp>
+#include <cstddef>
+
+// Address space for one of a VM's stacks. All of it is reserved up front but
+// the kernel only backs a page once it is touched, and the page after the end
+// is left inaccessible, so running off the stack faults there instead of
+// every push checking for room.
+class StackRegion {
+ public:
+  StackRegion() = default;
+
+  // rounded up to whole pages, throws std::bad_alloc if it can't be mapped
+  explicit StackRegion(size_t bytes);
+
+  ~StackRegion();
+
+  StackRegion(StackRegion&& other) noexcept;
+  StackRegion& operator=(StackRegion&& other) noexcept;
+
+  void* data() const { return base_; }
+  size_t size() const { return size_; }
+
+  bool InGuard(const void* address) const;
+
+ private:
+  char* base_{};
+  size_t size_{};
+};
+
+template <typename T>
+class Stack {
+ public:
+  Stack() = default;
+  explicit Stack(size_t capacity) : region_(capacity * sizeof(T)) {}
+
+  T* begin() const { return static_cast<T*>(region_.data()); }
+  T* end() const { return begin() + size(); }
+  T* data() const { return begin(); }
+  size_t size() const { return region_.size() / sizeof(T); }
+
+  const StackRegion& Region() const { return region_; }
+
+ private:
+  StackRegion region_;
+};
+
+// Where a fault on the guard page of either region jumps to. The innermost
+// trap entered on a thread is the one a fault goes to.
+struct OverflowTrap {
+  sigjmp_buf env;
+  const StackRegion* regions[2];
+  OverflowTrap* enclosing;
+};
+
+void EnterOverflowTrap(OverflowTrap* trap);
+
+void LeaveOverflowTrap(OverflowTrap* trap);
@@ -0,0 +1,147 @@
+#include "stream.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+
+static bool IsIdentifierChar(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+InterpreteResult SourceStream::Run() {
+  for (;;) {
+    size_t end = FindDeclarationEnd();
+
+    if (end == npos) {
+      if (!Fill()) eof_ = true;
+      continue;
+    }
+
+    if (end == begin_) return InterpreteResult::Ok;
+
+    auto result = vm_->Interpret(std::string_view(buffer_.data() + begin_, end - begin_), line_);
+    if (result != InterpreteResult::Ok) return result;
+
+    Consume(end);
+  }
+}
+
+bool SourceStream::Fill() {
+  // drop consumed declarations before growing, the buffer only ever holds
+  // the declaration currently being assembled plus one chunk
+  if (begin_ > 0) {
+    std::copy(buffer_.begin() + begin_, buffer_.begin() + end_, buffer_.begin());
+    end_ -= begin_;
+    scan_ -= begin_;
+    if (pending_ != npos) pending_ -= begin_;
+    begin_ = 0;
+  }
+
+  if (buffer_.size() - end_ < CHUNK_SIZE) {
+    buffer_.resize(end_ + CHUNK_SIZE);
+  }
+
+  for (;;) {
+    ssize_t n = read(fd_, buffer_.data() + end_, CHUNK_SIZE);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      perror("read");
+      return false;
+    }
+
+    end_ += n;
+    return n > 0;
+  }
+}
+
+size_t SourceStream::FindDeclarationEnd() {
+  for (; scan_ < end_; ++scan_) {
+    char c = buffer_[scan_];
+
+    if (in_comment_) {
+      if (c == '\n') in_comment_ = false;
+      continue;
+    }
+
+    if (in_string_) {
+      if (c == '"') in_string_ = false;
+      continue;
+    }
+
+    bool has_next = scan_ + 1 < end_;
+    if (c == '/' && !has_next && !eof_) return npos;
+    if (c == '/' && has_next && buffer_[scan_ + 1] == '/') {
+      in_comment_ = true;
+      ++scan_;
+      continue;
+    }
+
+    if (pending_ != npos) {
+      if (c == ' ' || c == '\t' || c == '\r' || c == '\n') continue;
+
+      // a statement followed by 'else' still belongs to the enclosing if
+      if (c == 'e') {
+        if (scan_ + 5 > end_ && !eof_) return npos;
+
+        std::string_view rest(buffer_.data() + scan_, std::min<size_t>(5, end_ - scan_));
+        if (rest.starts_with("else") && (rest.size() == 4 || !IsIdentifierChar(rest[4]))) {
+          pending_ = npos;
+          scan_ += 3;
+          continue;
+        }
+      }
+
+      // after a '}' these continue a map literal's expression; the odd
+      // statement starting with '[', '-' or '!' after a block just runs
+      // together with it, which is harmless where splitting a declaration
+      // isn't
+      bool after_brace = buffer_[pending_ - 1] == '}';
+      if (after_brace && std::string_view(";,)[].+-*/<>=!").find(c) != std::string_view::npos) {
+        pending_ = npos;
+      } else {
+        size_t end = pending_;
+        pending_ = npos;
+        return end;
+      }
+    }
+
+    switch (c) {
+      case '"':
+        in_string_ = true;
+        break;
+      case '(':
+      case '[':
+      case '{':
+        depth_++;
+        break;
+      case ')':
+      case ']':
+        depth_--;
+        break;
+      case '}':
+        if (--depth_ == 0) pending_ = scan_ + 1;
+        break;
+      case ';':
+        if (depth_ == 0) pending_ = scan_ + 1;
+        break;
+      default:
+        break;
+    }
+  }
+
+  if (!eof_) return npos;
+
+  // whatever is left is handed to the compiler, which reports anything
+  // unterminated
+  pending_ = npos;
+  return end_;
+}
+
+void SourceStream::Consume(size_t end) {
+  line_ += std::count(buffer_.begin() + begin_, buffer_.begin() + end, '\n');
+  begin_ = end;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+#include "vm.h"
+
+// Feeds source read from a file descriptor to the VM one top-level
+// declaration at a time, so a script can run while it is still being written
+// to a pipe. Only the declaration being assembled is kept in memory.
+class SourceStream {
+ public:
+  inline static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+  SourceStream(int fd, VM* vm) : fd_(fd), vm_(vm) {}
+
+  InterpreteResult Run();
+
+ private:
+  inline static constexpr size_t npos = static_cast<size_t>(-1);
+
+  // Reads one chunk, returns false on end of input.
+  bool Fill();
+
+  // Offset one past the next complete declaration, npos if more input is needed.
+  size_t FindDeclarationEnd();
+
+  void Consume(size_t end);
+
+  int fd_;
+  VM* vm_;
+
+  std::vector<char> buffer_;
+  size_t begin_{};
+  size_t end_{};
+  bool eof_{};
+
+  int line_{1};
+
+  // boundary scan state, kept across Fill() so each byte is scanned once
+  size_t scan_{};
+  int depth_{};
+  bool in_string_{};
+  bool in_comment_{};
+  size_t pending_{npos};
+};
@@ -1,150 +1,184 @@
 #include "table.h"
-// HashTable::Entry* HashTable::begin() {
-//   auto idx = 0;
-//   if (capacity_ <= idx) return nullptr;
-//
-//   while (idx < capacity_ && entries_[idx].key == nullptr) {
-//     idx++;
-//   }
-//   if (idx == capacity_) return nullptr;
-//
-//   return entries_ + idx;
-// }
-//
-// HashTable::Entry* HashTable::end() { return nullptr; }
-//
-// Value* HashTable::Get(ObjString* key) {
-//   if (count_ == 0) return nullptr;
-//
-//   auto entry = FindEntry(entries_, capacity_, key);
-//
-//   if (entry->key == nullptr) return nullptr;
-//
-//   return &entry->value;
-// }
-//
-// bool HashTable::Insert(ObjString* key, Value value) {
-//   if (key == nullptr) return false;
-//
-//   if (count_ + 1 >= ((double)capacity_ * load_factor_)) {
-//     auto new_capacity = GROW_CAPACITY(capacity_);
-//     Adjust(new_capacity);
-//   }
-//
-//   auto entry = FindEntry(entries_, capacity_, key);
-//
-//   // update
-//   if (entry->key != nullptr) {
-//     entry->value = value;
-//     return false;
-//   }
-//
-//   // new entry not tombstone
-//   if (entry->key == nullptr && IS_NIL(entry->value)) {
-//     count_++;
-//   }
-//
-//   entry->key = key;
-//   entry->value = value;
-//
-//   return true;
-// }
-//
-// bool HashTable::Delete(ObjString* key) {
-//   if (count_ == 0) return false;
-//
-//   auto entry = FindEntry(entries_, capacity_, key);
-//
-//   if (entry->key == nullptr) {
-//     return false;
-//   }
-//
-//   // tombstone
-//   entry->key = nullptr;
-//   entry->value = BOOL_VAL(true);
-//
-//   return true;
-// }
-//
-// void HashTable::Merge(HashTable* other_table) {
-//   for (auto entry : *other_table) {
-//     if (entry.key != nullptr) Insert(entry.key, entry.value);
-//   }
-// }
-//
-// ObjString* HashTable::FindString(const char* chars, int length, uint32_t
-// hash) {
-//   if (count_ == 0) return nullptr;
-//
-//   auto idx = hash % capacity_;
-//
-//   for (;;) {
-//     auto entry = entries_ + idx;
-//
-//     if (entry->key == nullptr) {
-//       if (IS_NIL(entry->value)) return nullptr;
-//     } else if (entry->key->hash == hash && entry->key->length == length &&
-//                memcmp(entry->key->chars, chars, length) == 0) {
-//       return entry->key;
-//     }
-//
-//     idx = (idx + 1) % capacity_;
-//   }
-// }
-//
-// HashTable::~HashTable() {
-//   capacity_ = 0;
-//   count_ = 0;
-//   delete[] entries_;
-// }
-//
-// void HashTable::Adjust(int new_capacity) {
-//   Entry* new_entries = new Entry[new_capacity]{};
-//
-//   if (entries_ == nullptr) {
-//     entries_ = new_entries;
-//     capacity_ = new_capacity;
-//     return;
-//   }
-//
-//   count_ = 0;
-//   for (int i = 0; i < capacity_; ++i) {
-//     if (entries_[i].key == nullptr) continue;
-//
-//     auto new_entry = FindEntry(new_entries, new_capacity, entries_[i].key);
-//     assert(new_entry->key == nullptr);
-//
-//     new_entry->key = entries_[i].key;
-//     new_entry->value = entries_[i].value;
-//     count_++;
-//   }
-//
-//   delete[] entries_;
-//
-//   entries_ = new_entries;
-//   capacity_ = new_capacity;
-// }
-//
-// HashTable::Entry* HashTable::FindEntry(HashTable::Entry* entries, int
-// capacity,
-//                                        ObjString* key) {
-//   auto idx = key->hash % capacity;
-//   Entry* tombstone = nullptr;
-//
-//   for (;;) {
-//     auto entry = entries + idx;
-//
-//     if (entry->key == nullptr && IS_BOOL(entry->value)) {
-//       if (tombstone == nullptr) tombstone = entry;
-//       continue;
-//     }
-//
-//     if (entry->key == key) return entry;
-//
-//     if (entry->key == nullptr) {
-//       return tombstone == nullptr ? entry : tombstone;
-//     }
-//
-//     idx = (idx + 1) % capacity;
-//   }
-// }
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+constexpr size_t kMinCapacity = 16;
+
+// finalizer of MurmurHash3, so the low 7 bits and the rest both vary
+size_t Mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// bit i set for each of the group's 16 control bytes equal to byte
+uint32_t MatchByte(const int8_t* group, int8_t byte) {
+#if defined(__SSE2__)
+  auto control = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(byte)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < 16; ++i) mask |= static_cast<uint32_t>(group[i] == byte) << i;
+  return mask;
+#endif
+}
+
+// empty and deleted slots, the only control bytes with the sign bit set
+uint32_t MatchFree(const int8_t* group) {
+#if defined(__SSE2__)
+  return _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(group)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < 16; ++i) mask |= static_cast<uint32_t>(group[i] < 0) << i;
+  return mask;
+#endif
+}
+
+int8_t ControlByte(size_t hash) { return static_cast<int8_t>(hash & 0x7f); }
+
+}  // namespace
+
+size_t HashTable::Hash(Value key) {
+  if (IsNumber(key)) {
+    // -0 and 0 are the same key
+    double number = AsNumber(key) == 0 ? 0.0 : AsNumber(key);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return Mix(bits);
+  }
+
+  if (std::holds_alternative<bool>(key)) return Mix(std::get<bool>(key) ? 2 : 1);
+  if (IsNil(key)) return Mix(0);
+
+  if (IsString(key)) return Mix(AsString(key)->hash);
+  return Mix(reinterpret_cast<uintptr_t>(std::get<Object*>(key)));
+}
+
+bool HashTable::KeysEqual(Value a, Value b) {
+  if (a.index() != b.index()) return false;
+  if (!std::holds_alternative<Object*>(a)) return a == b;
+
+  auto object_a = std::get<Object*>(a);
+  auto object_b = std::get<Object*>(b);
+  if (object_a == object_b) return true;
+
+  // strings are only interned per heap, a VM's and its program's can differ
+  if (!IsString(a) || !IsString(b)) return false;
+  auto string_a = AsString(a);
+  auto string_b = AsString(b);
+  return string_a->hash == string_b->hash && string_a->length == string_b->length &&
+         memcmp(string_a->content, string_b->content, string_a->length) == 0;
+}
+
+Value* HashTable::Get(Value key) {
+  auto slot = Find(key, Hash(key));
+  return slot == -1 ? nullptr : &entries_[slot].value;
+}
+
+bool HashTable::Insert(Value key, Value value) {
+  auto hash = Hash(key);
+  if (auto slot = Find(key, hash); slot != -1) {
+    entries_[slot].value = value;
+    return false;
+  }
+
+  if (growth_left_ == 0) {
+    // mostly deleted slots are cleaned out at the same size
+    auto limit = capacity_ / 8 * 7;
+    Resize(capacity_ == 0 ? kMinCapacity : count_ < limit / 2 ? capacity_ : capacity_ * 2);
+  }
+
+  auto slot = FindFree(hash);
+  if (control_[slot] == EMPTY) --growth_left_;
+
+  control_[slot] = ControlByte(hash);
+  entries_[slot] = {key, value};
+  ++count_;
+  return true;
+}
+
+bool HashTable::Delete(Value key) {
+  auto slot = Find(key, Hash(key));
+  if (slot == -1) return false;
+
+  // Probes only go on past groups without an empty slot, so in a group
+  // that has one the slot can be emptied rather than marked deleted.
+  auto group = control_.get() + slot / GROUP_SIZE * GROUP_SIZE;
+  if (MatchByte(group, EMPTY) != 0) {
+    control_[slot] = EMPTY;
+    ++growth_left_;
+  } else {
+    control_[slot] = DELETED;
+  }
+
+  entries_[slot] = {};
+  --count_;
+  return true;
+}
+
+ptrdiff_t HashTable::Find(Value key, size_t hash) const {
+  if (capacity_ == 0) return -1;
+
+  auto mask = capacity_ / GROUP_SIZE - 1;
+  auto group = (hash >> 7) & mask;
+  auto h2 = ControlByte(hash);
+
+  // triangular steps visit every group of a power of two table
+  for (size_t step = 1;; ++step) {
+    auto control = control_.get() + group * GROUP_SIZE;
+
+    for (auto match = MatchByte(control, h2); match != 0; match &= match - 1) {
+      auto slot = group * GROUP_SIZE + std::countr_zero(match);
+      if (KeysEqual(entries_[slot].key, key)) return slot;
+    }
+
+    if (MatchByte(control, EMPTY) != 0) return -1;
+    group = (group + step) & mask;
+  }
+}
+
+size_t HashTable::FindFree(size_t hash) const {
+  auto mask = capacity_ / GROUP_SIZE - 1;
+  auto group = (hash >> 7) & mask;
+
+  for (size_t step = 1;; ++step) {
+    if (auto match = MatchFree(control_.get() + group * GROUP_SIZE); match != 0) {
+      return group * GROUP_SIZE + std::countr_zero(match);
+    }
+    group = (group + step) & mask;
+  }
+}
+
+void HashTable::Resize(size_t new_capacity) {
+  auto old_control = std::move(control_);
+  auto old_entries = std::move(entries_);
+  auto old_capacity = capacity_;
+
+  control_ = std::make_unique<int8_t[]>(new_capacity);
+  entries_ = std::make_unique<Entry[]>(new_capacity);
+  std::fill_n(control_.get(), new_capacity, EMPTY);
+  capacity_ = new_capacity;
+
+  // the table keeps at least one slot in eight empty, so probes end
+  growth_left_ = new_capacity / 8 * 7 - count_;
+
+  for (size_t i = 0; i < old_capacity; ++i) {
+    if (old_control[i] < 0) continue;
+
+    auto hash = Hash(old_entries[i].key);
+    auto slot = FindFree(hash);
+    control_[slot] = ControlByte(hash);
+    entries_[slot] = old_entries[i];
+  }
+}
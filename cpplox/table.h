@@ -1,42 +1,73 @@
 #pragma once
 
-#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 
 #include "object.h"
 #include "value.h"
 
-// class HashTable {
-//  private:
-//   inline constexpr static double load_factor_ = 0.75;
+// An open-addressing hash table from Values to Values, laid out like a Swiss
+// table. Slots come in groups of 16 with one control byte each, holding
+// EMPTY, DELETED or the low 7 bits of the key's hash. A lookup compares the
+// whole group's control bytes with those bits at once and only looks at the
+// keys that match, so most misses never touch an entry.
 //
-//   struct Entry {
-//     String* key{};
-//     Value value{};
-//   };
-//
-//  public:
-//   Entry* begin();
-//
-//   Entry* end();
-//
-//   Value* Get(String* key);
-//
-//   bool Insert(String* key, Value value);
-//
-//   bool Delete(String* key);
-//
-//   void Merge(HashTable* other_table);
-//
-//   String* FindString(const char* chars, int length, uint32_t hash);
-//
-//   ~HashTable();
-//
-//  private:
-//   void Adjust(int new_capacity);
-//
-//   Entry* FindEntry(Entry* entries, int capacity, String* key);
-//
-//   int capacity_{};
-//   int count_{};
-//   Entry* entries_{};
-// };
+// Keys are compared by value for nil, booleans, numbers and strings, and by
+// identity for other objects.
+class HashTable {
+ public:
+  struct Entry {
+    Value key{};
+    Value value{};
+  };
+
+  HashTable() = default;
+
+  HashTable(const HashTable&) = delete;
+  HashTable& operator=(const HashTable&) = delete;
+
+  // nullptr if key isn't in the table
+  Value* Get(Value key);
+
+  // true if key is new
+  bool Insert(Value key, Value value);
+
+  // false if key wasn't in the table
+  bool Delete(Value key);
+
+  size_t Size() const { return count_; }
+
+  // calls f(const Entry&) for each entry, in slot order
+  template <typename F>
+  void ForEach(F f) const {
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (control_[i] >= 0) f(entries_[i]);
+    }
+  }
+
+  static size_t Hash(Value key);
+
+  static bool KeysEqual(Value a, Value b);
+
+ private:
+  inline static constexpr size_t GROUP_SIZE = 16;
+  inline static constexpr int8_t EMPTY = -128;
+  inline static constexpr int8_t DELETED = -2;
+
+  // slot of key, or -1
+  ptrdiff_t Find(Value key, size_t hash) const;
+
+  // the first empty or deleted slot on hash's probe sequence
+  size_t FindFree(size_t hash) const;
+
+  void Resize(size_t new_capacity);
+
+  std::unique_ptr<int8_t[]> control_;
+  std::unique_ptr<Entry[]> entries_;
+  // a power of two number of groups
+  size_t capacity_{};
+  size_t count_{};
+  // empty slots left before the table has to grow, deleted ones don't count
+  size_t growth_left_{};
+};
@@ -1,13 +1,43 @@
 #include "value.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <memory>
+#include <new>
 #include <type_traits>
 #include <variant>
+#include <vector>
 
 #include "chunk.h"
+#include "class.h"
+#include "collection.h"
+#include "float64_array.h"
 
-Function::Function() : Object(), chunk(std::make_unique<Chunk>()) { type = ObjectType::Function; }
+Closure::Closure(Function* func)
+    : Object(), func(func), captured_count(func->captured_count), upvalue_count(func->upvalue_count) {
+  type = ObjectType::Closure;
+  if (func->cache_count > 0) caches = std::make_unique<std::atomic<Property*>[]>(func->cache_count);
+}
+
+Closure::Closure() : Object(), func(nullptr), captured_count(0), upvalue_count(0) {
+  type = ObjectType::Closure;
+}
+
+Closure* Closure::New() { return new (::operator new(sizeof(Closure))) Closure(); }
+
+Closure* Closure::New(Function* func) {
+  auto size = sizeof(Closure) + func->captured_count * sizeof(Value) + func->upvalue_count * sizeof(Upvalue*);
+  auto closure = new (::operator new(size)) Closure(func);
+  std::uninitialized_value_construct_n(closure->Captured().data(), closure->captured_count);
+  std::uninitialized_value_construct_n(closure->Upvalues().data(), closure->upvalue_count);
+  return closure;
+}
+
+void Closure::Free(Closure* closure) {
+  closure->~Closure();
+  ::operator delete(closure);
+}
 
 // helper type for the visitor #4
 template <class... Ts>
@@ -24,6 +54,9 @@ bool ValuesEqual(Value a, Value b) {
                         [](bool b1, bool b2) { return b1 == b2; },
                         [](double d1, double d2) { return d1 == d2; },
                         [](Object* a, Object* b) {
+                          if (a == b) return true;
+                          if (a->type != ObjectType::String || b->type != ObjectType::String) return false;
+
                           auto a_string = reinterpret_cast<String*>(a);
                           auto b_string = reinterpret_cast<String*>(b);
 
@@ -35,7 +68,15 @@ bool ValuesEqual(Value a, Value b) {
                     a, b);
 }
 
+// lists and maps being printed, so one that holds itself prints as [...]
+static thread_local std::vector<Object*> printing;
+
 static void PrintObject(Object* obj) {
+  if (std::find(printing.begin(), printing.end(), obj) != printing.end()) {
+    printf(obj->type == ObjectType::List ? "[...]" : "{...}");
+    return;
+  }
+
   switch (obj->type) {
     case ObjectType::String: {
       auto string = reinterpret_cast<String*>(obj);
@@ -44,10 +85,10 @@ static void PrintObject(Object* obj) {
     }
     case ObjectType::Function: {
       auto function = reinterpret_cast<Function*>(obj);
-      if (function->name == nullptr) {
+      if (function->info->name == nullptr) {
         printf("<script>");
       } else {
-        printf("<fn %s -> %d>", function->name->GetCString(), function->arity);
+        printf("<fn %s -> %d>", function->GetName(), function->arity);
       }
       break;
     }
@@ -55,10 +96,10 @@ static void PrintObject(Object* obj) {
       auto closure = reinterpret_cast<Closure*>(obj);
       auto function = closure->func;
 
-      if (function->name == nullptr) {
+      if (function->info->name == nullptr) {
         printf("<script>");
       } else {
-        printf("<fn %s -> %d>", function->name->GetCString(), function->arity);
+        printf("<fn %s -> %d>", function->GetName(), function->arity);
       }
       break;
     }
@@ -73,6 +114,76 @@ static void PrintObject(Object* obj) {
       break;
     }
 
+    case ObjectType::Fiber: {
+      printf("<fiber>");
+      break;
+    }
+
+    case ObjectType::Channel: {
+      printf("<channel>");
+      break;
+    }
+
+    case ObjectType::Float64Array: {
+      auto array = reinterpret_cast<Float64Array*>(obj);
+      printf("[");
+      for (size_t i = 0; i < array->length; ++i) {
+        printf(i == 0 ? "%g" : ", %g", array->data[i]);
+      }
+      printf("]");
+      break;
+    }
+
+    case ObjectType::Class: {
+      printf("%s", reinterpret_cast<Class*>(obj)->name->GetCString());
+      break;
+    }
+
+    case ObjectType::Instance: {
+      printf("%s instance", reinterpret_cast<Instance*>(obj)->shape->klass->name->GetCString());
+      break;
+    }
+
+    case ObjectType::BoundMethod: {
+      PrintObject(reinterpret_cast<BoundMethod*>(obj)->method);
+      break;
+    }
+
+    case ObjectType::List: {
+      printing.push_back(obj);
+      printf("[");
+      auto& values = reinterpret_cast<List*>(obj)->values;
+      for (size_t i = 0; i < values.size(); ++i) {
+        if (i != 0) printf(", ");
+        PrintValue(values[i]);
+      }
+      printf("]");
+      printing.pop_back();
+      break;
+    }
+
+    case ObjectType::Map: {
+      printing.push_back(obj);
+      printf("{");
+      bool first = true;
+      reinterpret_cast<Map*>(obj)->table.ForEach([&first](const HashTable::Entry& entry) {
+        if (!first) printf(", ");
+        first = false;
+        PrintValue(entry.key);
+        printf(": ");
+        PrintValue(entry.value);
+      });
+      printf("}");
+      printing.pop_back();
+      break;
+    }
+
+    case ObjectType::Generator: {
+      auto generator = reinterpret_cast<Generator*>(obj);
+      printf("<generator %s>", generator->closure->func->GetName());
+      break;
+    }
+
     // case ObjectType::Upvalue: {
     //   printf("upvalue");
     //   break;
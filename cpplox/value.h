@@ -1,16 +1,19 @@
 #pragma once
 
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <functional>
 #include <memory>
+#include <span>
 #include <string>
 #include <variant>
 
 #include "common.h"
 #include "scanner.h"
 
-class Chunk;
+struct Function;
+class VM;
 
 enum class ObjectType {
   String,
@@ -18,18 +21,31 @@ enum class ObjectType {
   NativeFunction,
   Closure,
   Upvalue,
+  Fiber,
+  Generator,
+  Channel,
+  Float64Array,
+  List,
+  Map,
+  Class,
+  Instance,
+  BoundMethod,
 };
 
 struct Object {
   ObjectType type{};
   Object* next{};
   bool is_marked{};
+  // owned by a CompiledProgram shared between VMs, never marked or freed by them
+  bool is_immortal{};
 };
 
+// The bytes follow the object in the same allocation, NUL-terminated; only
+// a Heap makes strings.
 struct String : Object {
   size_t hash;
-  char* content;
   int length;
+  char content[];
 
   String() : Object() { type = ObjectType::String; }
 
@@ -42,27 +58,27 @@ struct String : Object {
   }
 };
 
-struct Function : Object {
-  int arity{};
-  int upvalue_count{};
-  std::unique_ptr<Chunk> chunk{};
-  String* name{};
-
-  Function();
-
-  const char* GetName() {
-    assert(name != nullptr);
-    return name->GetCString();
-  }
-};
-
 using Nil = std::monostate;
 using Value = std::variant<Nil, bool, double, Object*>;
 
-using NativeFunctor = std::function<Value(int argc, Value* argv)>;
+// argv holds the argc arguments, argv[-1] is the native being called; vm is
+// the VM making the call
+using NativeFunctor = std::function<Value(VM* vm, int argc, Value* argv)>;
+using NativeFn = Value (*)(VM* vm, int argc, Value* argv);
+
+struct Foreign;
+
 struct NativeFunction : Object {
   String* name{};
+  // called directly when set, the functor is only for natives with state
+  NativeFn function{};
   NativeFunctor native_functor;
+  // checked by the VM before the call, -1 if the native checks argc itself
+  int arity{-1};
+  // the library symbol a foreign function calls, owned by the native
+  Foreign* foreign{};
+  // the Intrinsic this native backs, -1 if none
+  int intrinsic{-1};
 };
 
 struct Upvalue : Object {
@@ -74,13 +90,50 @@ struct Upvalue : Object {
   Upvalue(Value* slot) : location(slot), closed(), next(nullptr) { type = ObjectType::Upvalue; }
 };
 
+struct Property;
+
+// The captured values and then the upvalues follow the closure in the same
+// allocation, so closures are made with New and freed with Free.
 struct Closure : Object {
   Function* func;
-  std::vector<Upvalue*> upvalues;
+  int captured_count;
+  int upvalue_count;
+  // the property each access site last resolved, checked against the
+  // receiver's shape before use
+  std::unique_ptr<std::atomic<Property*>[]> caches;
+
+  static Closure* New(Function* func);
+  // one that captures nothing, for a function still being compiled
+  static Closure* New();
+  static void Free(Closure* closure);
+
+  std::span<Value> Captured() {
+    return {reinterpret_cast<Value*>(this + 1), static_cast<size_t>(captured_count)};
+  }
 
-  Closure(Function* func) : func(func), upvalues(func->upvalue_count) { 
-    type = ObjectType::Closure; 
+  std::span<Upvalue*> Upvalues() {
+    auto end = reinterpret_cast<Value*>(this + 1) + captured_count;
+    return {reinterpret_cast<Upvalue**>(end), static_cast<size_t>(upvalue_count)};
   }
+
+ private:
+  explicit Closure(Function* func);
+  Closure();
+};
+
+// A suspended call of a generator function. Between resumes the frame's live
+// stack values are kept in slots (slot 0 is the closure) and the upvalues
+// still open on them point there; resuming copies them back on top of the
+// caller's stack.
+struct Generator : Object {
+  Closure* closure;
+  const uint8_t* ip{};
+  std::vector<Value> slots;
+  Upvalue* open_upvalues{};
+  bool running{};
+  bool done{};
+
+  Generator(Closure* closure) : closure(closure) { type = ObjectType::Generator; }
 };
 
 inline NativeFunction* NewNativeFunction(String* name, NativeFunctor functor) {
@@ -89,6 +142,12 @@ inline NativeFunction* NewNativeFunction(String* name, NativeFunctor functor) {
   return nf;
 }
 
+inline NativeFunction* NewNativeFunction(String* name, NativeFn function, int arity) {
+  NativeFunction* nf = new NativeFunction{.name = name, .function = function, .arity = arity};
+  nf->type = ObjectType::NativeFunction;
+  return nf;
+}
+
 constexpr inline bool IsNil(Value value) { return std::holds_alternative<std::monostate>(value); }
 
 constexpr inline bool IsString(Value value) {
@@ -1,91 +1,156 @@
 #include "vm.h"
 
+#include <bit>
+#include <cmath>
 #include <cstdarg>
 #include <cstdio>
 #include <iterator>
+#include <mutex>
+#include <thread>
 
 #include "chunk.h"
+#include "class.h"
+#include "collection.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "event_loop.h"
 #include "ffi.h"
+#include "fiber.h"
+#include "float64_array.h"
+#include "intrinsic.h"
 #include "memory.h"
 #include "object.h"
 #include "opcode.h"
+#include "parallel.h"
 #include "parser.h"
+#include "program.h"
+#include "scheduler.h"
 #include "value.h"
 
-int FFI = []() -> int {
-  DefineNativeFunction("unix", &Unix);
-  return 10;
-}();
-
 VM::VM()
-    : stack(8191),
+    : stack(STACK_MAX),
+      stack_top(stack.begin()),
+      globals(own_globals_),
+      frames(FRAMES_MAX),
+      frame_pointer_(frames.begin()),
+      owner_(this) {
+  RegisterNatives(this);
+}
+
+VM::VM(VM* owner)
+    : stack(STACK_MAX),
       stack_top(stack.begin()),
-      frames(256),
+      globals(owner->globals),
+      frames(FRAMES_MAX),
       frame_pointer_(frames.begin()),
-      open_upvalues(nullptr) {}
+      owner_(owner),
+      globals_lock_(owner->globals_lock_) {}
+
+VM::~VM() = default;
+
+void VM::DefineNativeFunction(const char* name, NativeFunctor func) {
+  String* str = AsString(AllocateString(name));
+  Object* nf = NewNativeFunction(str, func);
+
+  InsertObject(nf);
+
+  globals.insert({str->hash, nf});
+}
 
-InterpreteResult VM::Interpret(const char* source) {
-  Compiler compiler(source, this);
+void VM::DefineNativeFunction(const char* name, NativeFn func, int arity) {
+  String* str = AsString(AllocateString(name));
+  Object* nf = NewNativeFunction(str, func, arity);
 
-  auto function = compiler.Compile().release();
+  InsertObject(nf);
+
+  globals.insert({str->hash, nf});
+}
+
+InterpreteResult VM::Interpret(std::string_view source, int line) {
+  Compiler compiler(source, this, line);
+
+  // the script function is unreachable once it has run, so it is owned here
+  // rather than left on the object list
+  std::unique_ptr<Function, decltype(&Function::Free)> function(compiler.Compile(), &Function::Free);
 
   if (!function) return InterpreteResult::CompilerError;
 
-  InsertObject(function);
+  return Execute(function.get());
+}
 
+InterpreteResult VM::Interpret(const CompiledProgram& program) { return Execute(program.GetScript()); }
+
+InterpreteResult VM::Execute(Function* function) {
   Push(function);
 
-  Closure* closure = new Closure(function);
+  std::unique_ptr<Closure, decltype(&Closure::Free)> closure(Closure::New(function), &Closure::Free);
 
   Pop();
 
-  Push(closure);
+  Push(closure.get());
+
+  Call(closure.get(), 0);
 
-  Call(closure, 0);
+  printf("\n======================= run trace ============================\n");
 
-  return Run();
+  return RunToCompletion();
 }
 
-void VM::InsertObject(Object* object) {
-  object->next = objects;
-  objects = object;
+InterpreteResult VM::RunToCompletion() {
+  // fibers are resumed by their scheduler instead
+  auto result = Run();
+  while (result == InterpreteResult::Suspended) {
+    if (suspend == Suspend::Join) {
+      stack_top[-1] = GetScheduler()->Wait(join_target);
+    } else if (suspend == Suspend::Io) {
+      GetEventLoop()->Wait(io_request);
+      stack_top[-1] = io_request->ToValue(this);
+      delete io_request;
+    } else {
+      std::this_thread::yield();
+    }
+
+    suspend = Suspend::None;
+    result = Run();
+  }
+
+  return result;
 }
 
 void VM::RuntimeError(const char* format, ...) {
   va_list args;
   va_start(args, format);
 
-  fprintf(stderr, format, args);
+  vfprintf(stderr, format, args);
 
   va_end(args);
 
   fputs("\n", stderr);
 
-  for (int i = frames.size() - 1; i >= 0; --i) {
-    auto frame = &frames[i];
+  // only the live frames, innermost first, and only the ends of a deep stack
+  constexpr size_t kTraceEnds = 10;
+  size_t depth = frame_pointer_ - frames.begin();
+  for (size_t i = 0; i < depth; i++) {
+    if (depth > 2 * kTraceEnds && i == kTraceEnds) {
+      fprintf(stderr, "... %zu more frames\n", depth - 2 * kTraceEnds);
+      i = depth - kTraceEnds;
+    }
+
+    auto frame = frame_pointer_ - 1 - i;
     auto closure = frame->closure;
 
-    size_t instruction = frame->ip - closure->func->chunk->code.begin() - 1;
+    size_t instruction = frame->ip - closure->func->code - 1;
 
-    fprintf(stderr, "[line %d] in ", closure->func->chunk->line_info.GetLine(instruction));
+    fprintf(stderr, "[line %d] in ", closure->func->info->line_info.GetLine(instruction));
 
-    if (closure->func->name == nullptr) {
+    if (closure->func->info->name == nullptr) {
       fprintf(stderr, "script\n");
     } else {
-      fprintf(stderr, "%s()\n", closure->func->name->GetCString());
+      fprintf(stderr, "%s()\n", closure->func->GetName());
     }
   }
 
-  auto frame = frame_pointer_ - 1;
-
-  auto instruction = frame->ip - frame->closure->func->chunk->code.begin() - 1;
-  auto line = frame->closure->func->chunk->line_info.GetLine(instruction);
-
-  fprintf(stderr, "[line %d] in script", line);
-
   ResetStack();
 }
 
@@ -98,6 +163,92 @@ void VM::Concatenate() {
   Push(AllocateString(result));
 }
 
+// index as a position in [0, length), if it is a whole number in range
+static bool ToIndex(Value index, size_t length, size_t* position) {
+  if (!IsNumber(index)) return false;
+
+  auto number = AsNumber(index);
+  if (number < 0 || number >= static_cast<double>(length) || number != std::floor(number)) return false;
+
+  *position = static_cast<size_t>(number);
+  return true;
+}
+
+bool VM::GetIndex(Value target, Value index, Value* result) {
+  if (IsMap(target)) {
+    auto value = AsMap(target)->table.Get(index);
+    if (value == nullptr) {
+      RuntimeError("Key not found.");
+      return false;
+    }
+    *result = *value;
+    return true;
+  }
+
+  size_t position;
+  if (IsList(target)) {
+    auto& values = AsList(target)->values;
+    if (!ToIndex(index, values.size(), &position)) {
+      RuntimeError("Index out of range.");
+      return false;
+    }
+    *result = values[position];
+    return true;
+  }
+
+  if (IsFloat64Array(target)) {
+    auto array = AsFloat64Array(target);
+    if (!ToIndex(index, array->length, &position)) {
+      RuntimeError("Index out of range.");
+      return false;
+    }
+    *result = array->data[position];
+    return true;
+  }
+
+  RuntimeError("Only lists, maps and arrays can be indexed.");
+  return false;
+}
+
+bool VM::SetIndex(Value target, Value index, Value value) {
+  if (IsMap(target)) {
+    if (IsNumber(index) && std::isnan(AsNumber(index))) {
+      RuntimeError("Map keys can't be NaN.");
+      return false;
+    }
+    AsMap(target)->table.Insert(index, value);
+    return true;
+  }
+
+  size_t position;
+  if (IsList(target)) {
+    auto& values = AsList(target)->values;
+    if (!ToIndex(index, values.size(), &position)) {
+      RuntimeError("Index out of range.");
+      return false;
+    }
+    values[position] = value;
+    return true;
+  }
+
+  if (IsFloat64Array(target)) {
+    auto array = AsFloat64Array(target);
+    if (!ToIndex(index, array->length, &position)) {
+      RuntimeError("Index out of range.");
+      return false;
+    }
+    if (!IsNumber(value)) {
+      RuntimeError("Float64Array elements must be numbers.");
+      return false;
+    }
+    array->data[position] = AsNumber(value);
+    return true;
+  }
+
+  RuntimeError("Only lists, maps and arrays can be indexed.");
+  return false;
+}
+
 static bool IsFalsey(Value value) {
   return std::holds_alternative<std::monostate>(value) ||
          (std::holds_alternative<bool>(value) && !std::get<bool>(value));
@@ -105,23 +256,118 @@ static bool IsFalsey(Value value) {
 
 bool VM::Call(Closure* closure, int arg_count) {
   if (arg_count != closure->func->arity) {
-    RuntimeError("Expected %d arguments but got %d", closure->func->arity, arg_count);
+    auto lifted = closure->func->lifted_count;
+    RuntimeError("Expected %d arguments but got %d", closure->func->arity - lifted, arg_count - lifted);
     return false;
   }
 
   auto frame = frame_pointer_++;
   frame->closure = closure;
-  frame->ip = closure->func->chunk->code.begin();
+  frame->ip = closure->func->code;
   frame->slots = stack_top - arg_count - 1;
+  frame->generator = nullptr;
+
+  return true;
+}
+
+bool VM::NewGenerator(Closure* closure, int arg_count) {
+  if (arg_count != closure->func->arity) {
+    RuntimeError("Expected %d arguments but got %d", closure->func->arity, arg_count);
+    return false;
+  }
+
+  auto generator = new Generator(closure);
+  InsertObject(generator);
+
+  auto base = stack_top - arg_count - 1;
+  generator->slots.assign(base, stack_top);
+  generator->ip = closure->func->code;
+
+  stack_top = base;
+  Push(generator);
 
   return true;
 }
 
+bool VM::Resume(Generator* generator, int arg_count) {
+  if (arg_count != 0) {
+    RuntimeError("Expected 0 arguments but got %d", arg_count);
+    return false;
+  }
+
+  if (generator->running) {
+    RuntimeError("Generator is already running.");
+    return false;
+  }
+
+  auto base = stack_top - 1;
+
+  // a finished generator keeps returning nil
+  if (generator->done) {
+    *base = Nil{};
+    return true;
+  }
+
+  stack_top = std::copy(generator->slots.begin(), generator->slots.end(), base);
+
+  // upvalues open on the frame's slots move back onto the stack with them
+  for (auto upvalue = generator->open_upvalues; upvalue != nullptr; upvalue = upvalue->next) {
+    upvalue->location = base + (upvalue->location - generator->slots.data());
+    OpenUpvalue(upvalue);
+  }
+  generator->open_upvalues = nullptr;
+
+  auto frame = frame_pointer_++;
+  frame->closure = generator->closure;
+  frame->ip = generator->ip;
+  frame->slots = base;
+  frame->generator = generator;
+
+  generator->running = true;
+
+  return true;
+}
+
+void VM::Yield(Value value) {
+  auto frame = frame_pointer_ - 1;
+  auto generator = frame->generator;
+  auto base = frame->slots;
+
+  generator->slots.assign(base, stack_top);
+  generator->ip = frame->ip;
+  generator->running = false;
+
+  // upvalues open on the frame's slots move with the values
+  TakeOpenUpvalues(base, [generator, base](Upvalue* upvalue) {
+    upvalue->location = generator->slots.data() + (upvalue->location - base);
+    upvalue->next = generator->open_upvalues;
+    generator->open_upvalues = upvalue;
+  });
+
+  frame_pointer_--;
+  stack_top = base;
+  Push(value);
+}
+
 bool VM::CallNative(NativeFunction* function, int arg_count) {
-  Value result = function->native_functor(arg_count, std::addressof(*(stack_top - arg_count - 1)));
+  if (function->arity != -1 && arg_count != function->arity) {
+    RuntimeError("Expected %d arguments but got %d", function->arity, arg_count);
+    return false;
+  }
+
+  auto argv = std::addressof(*(stack_top - arg_count));
+  Value result = function->function != nullptr ? function->function(this, arg_count, argv)
+                                               : function->native_functor(this, arg_count, argv);
+
+  // a native reports an error through RuntimeError, which unwinds every frame
+  if (frame_pointer_ == frames.begin()) return false;
+
+  // back to the OP_CALL, so resuming makes the same call
+  if (suspend == Suspend::Retry) {
+    (frame_pointer_ - 1)->ip -= 2;
+    return true;
+  }
 
-  // auto frame = frame_pointer_ - 1;
-  // frame->slots = stack_top - arg_count - 1;
   stack_top -= arg_count + 1;
 
   Push(result);
@@ -133,11 +379,37 @@ bool VM::CallValue(Value callee, int arg_count) {
   if (std::holds_alternative<Object*>(callee)) {
     auto obj = std::get<Object*>(callee);
     switch (obj->type) {
-      case ObjectType::Closure:
-        return Call(reinterpret_cast<Closure*>(obj), arg_count);
+      case ObjectType::Closure: {
+        auto closure = reinterpret_cast<Closure*>(obj);
+        if (closure->func->is_generator) return NewGenerator(closure, arg_count);
+        return Call(closure, arg_count);
+      }
+      case ObjectType::Generator:
+        return Resume(reinterpret_cast<Generator*>(obj), arg_count);
       case ObjectType::NativeFunction:
         return CallNative(reinterpret_cast<NativeFunction*>(obj), arg_count);
 
+      case ObjectType::Class: {
+        auto klass = reinterpret_cast<Class*>(obj);
+        auto instance = new Instance(klass);
+        InsertObject(instance);
+        stack_top[-arg_count - 1] = instance;
+
+        if (!IsNil(klass->initializer)) return CallValue(klass->initializer, arg_count);
+
+        if (arg_count != 0) {
+          RuntimeError("Expected 0 arguments but got %d", arg_count);
+          return false;
+        }
+        return true;
+      }
+
+      case ObjectType::BoundMethod: {
+        auto bound = reinterpret_cast<BoundMethod*>(obj);
+        stack_top[-arg_count - 1] = bound->receiver;
+        return CallValue(bound->method, arg_count);
+      }
+
       default:
         break;
     }
@@ -162,7 +434,7 @@ uint16_t VM::ReadShort() {
 
 Value VM::ReadConstant() {
   auto frame = frame_pointer_ - 1;
-  return frame->closure->func->chunk->constants[ReadByte()];
+  return frame->closure->func->constants[ReadByte()];
 }
 
 String* VM::ReadString() { return AsString(ReadConstant()); }
@@ -200,43 +472,189 @@ void BinaryOp(VM* vm) {
   }
 }
 
-Upvalue* CaptureUpvalue(Value* local) {
-  Upvalue* pre_upvalue = nullptr;
-  auto upvalue = VM::GetInstance()->open_upvalues;
+Property* VM::LookupProperty(Instance* instance, String* name, std::atomic<Property*>* cache) {
+  auto property = cache->load(std::memory_order_acquire);
+  if (property != nullptr && property->shape == instance->shape) return property;
+
+  property = instance->shape->klass->Lookup(instance->shape, name);
+  cache->store(property, std::memory_order_release);
+  return property;
+}
 
-  while (upvalue != nullptr && upvalue->location > local) {
-    pre_upvalue = upvalue;
-    upvalue = upvalue->next;
+bool VM::BindMethod(Class* klass, String* name) {
+  auto iter = klass->methods.find(name->hash);
+  if (iter == klass->methods.end()) {
+    RuntimeError("Undefined property '%s'.", name->GetCString());
+    return false;
   }
 
-  if (upvalue != nullptr && upvalue->location == local) {
-    return upvalue;
+  auto bound = new BoundMethod(Peek(0), reinterpret_cast<Closure*>(std::get<Object*>(iter->second)));
+  InsertObject(bound);
+  stack_top[-1] = bound;
+  return true;
+}
+
+Upvalue* VM::CaptureUpvalue(Value* local) {
+  if (size_t slot = local - stack.data(); slot < open_upvalues.slots.size()) {
+    if (auto upvalue = open_upvalues.slots[slot]; upvalue != nullptr) return upvalue;
   }
 
-  Upvalue* created_upvalue = new Upvalue(local);
+  auto upvalue = new Upvalue(local);
+  InsertObject(upvalue);
+  OpenUpvalue(upvalue);
 
-  created_upvalue->next = upvalue;
+  return upvalue;
+}
 
-  if (pre_upvalue == nullptr) {
-    VM::GetInstance()->open_upvalues = created_upvalue;
-  } else {
-    pre_upvalue->next = created_upvalue;
+void VM::OpenUpvalue(Upvalue* upvalue) {
+  auto& open = open_upvalues;
+  size_t slot = upvalue->location - stack.data();
+  if (slot >= open.slots.size()) {
+    open.slots.resize(std::bit_ceil(std::max<size_t>(slot + 1, 256)));
+    open.bits.resize(open.slots.size() / 64);
   }
 
-  return created_upvalue;
+  open.slots[slot] = upvalue;
+  open.bits[slot / 64] |= uint64_t{1} << (slot % 64);
+  open.count++;
 }
 
-void CloseUpValue(Value* last) {
-  auto open_upvalues = VM::GetInstance()->open_upvalues;
+template <typename F>
+void VM::TakeOpenUpvalues(Value* first, F f) {
+  auto& open = open_upvalues;
+  if (open.count == 0) return;
+
+  size_t begin = first - stack.data();
+  size_t end = std::min<size_t>(stack_top - stack.begin(), open.slots.size());
+  for (auto word = begin / 64; word * 64 < end && open.count > 0; ++word) {
+    auto bits = open.bits[word];
+    if (word == begin / 64) bits &= ~uint64_t{0} << (begin % 64);
+    if (end - word * 64 < 64) bits &= (uint64_t{1} << (end - word * 64)) - 1;
+    open.bits[word] &= ~bits;
+
+    for (; bits != 0; bits &= bits - 1) {
+      auto slot = word * 64 + std::countr_zero(bits);
+      f(open.slots[slot]);
+      open.slots[slot] = nullptr;
+      open.count--;
+    }
+  }
+}
 
-  while (open_upvalues != nullptr && open_upvalues->location >= last) {
-    auto upvalue = open_upvalues;
+void VM::CloseUpValue(Value* last) {
+  TakeOpenUpvalues(last, [](Upvalue* upvalue) {
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    open_upvalues = open_upvalues->next;
+  });
+}
+
+// globals are only locked once a scheduler shares them between threads
+bool VM::GetGlobal(String* name, Value* value) {
+  auto guard = globals_lock_ ? std::shared_lock(*globals_lock_) : std::shared_lock<std::shared_mutex>();
+
+  auto iter = globals.find(name->hash);
+  if (iter == globals.end()) return false;
+
+  *value = iter->second;
+  return true;
+}
+
+bool VM::SetGlobal(String* name, Value value) {
+  auto guard = globals_lock_ ? std::unique_lock(*globals_lock_) : std::unique_lock<std::shared_mutex>();
+
+  auto iter = globals.find(name->hash);
+  if (iter == globals.end()) return false;
+
+  auto old_value = iter->second;
+  iter->second = value;
+
+  CheckIntrinsic(old_value);
+  CheckIntrinsic(value);
+  return true;
+}
+
+void VM::DefineGlobal(String* name, Value value) {
+  auto guard = globals_lock_ ? std::unique_lock(*globals_lock_) : std::unique_lock<std::shared_mutex>();
+
+  // redefining a global replaces it, natives included
+  auto [iter, inserted] = globals.try_emplace(name->hash, value);
+  if (inserted) return;
+
+  auto old_value = iter->second;
+  iter->second = value;
+
+  CheckIntrinsic(old_value);
+  CheckIntrinsic(value);
+}
+
+// the native behind an intrinsic, if value is one
+static NativeFunction* AsIntrinsicNative(Value value) {
+  if (!std::holds_alternative<Object*>(value)) return nullptr;
+
+  auto object = std::get<Object*>(value);
+  if (object->type != ObjectType::NativeFunction) return nullptr;
+
+  auto native = reinterpret_cast<NativeFunction*>(object);
+  return native->intrinsic != -1 ? native : nullptr;
+}
+
+void VM::CheckIntrinsic(Value value) {
+  auto native = AsIntrinsicNative(value);
+  if (native == nullptr) return;
+
+  auto iter = globals.find(native->name->hash);
+  uint32_t bit = 1u << native->intrinsic;
+  if (iter != globals.end() && iter->second == value) {
+    owner_->overridden_intrinsics_ &= ~bit;
+  } else {
+    owner_->overridden_intrinsics_ |= bit;
   }
 }
 
+void VM::RefreshIntrinsics() {
+  owner_->overridden_intrinsics_ = 0;
+
+  for (size_t i = 0; i < std::size(INTRINSICS); ++i) {
+    Value value;
+    GetGlobal(AsString(AllocateString(INTRINSICS[i].name)), &value);
+
+    auto native = AsIntrinsicNative(value);
+    if (native == nullptr || native->intrinsic != static_cast<int>(i)) {
+      owner_->overridden_intrinsics_ |= 1u << i;
+    }
+  }
+}
+
+void VM::SwapState(Fiber* fiber) {
+  std::swap(stack, fiber->stack);
+  std::swap(stack_top, fiber->stack_top);
+  std::swap(frames, fiber->frames);
+  std::swap(frame_pointer_, fiber->frame_pointer);
+  std::swap(open_upvalues, fiber->open_upvalues);
+}
+
+Scheduler* VM::GetScheduler() {
+  if (!owner_->scheduler_) {
+    owner_->scheduler_ = std::make_unique<Scheduler>(owner_, std::max(1u, std::thread::hardware_concurrency()));
+  }
+  return owner_->scheduler_.get();
+}
+
+EventLoop* VM::GetEventLoop() {
+  // async natives can be called from any of the scheduler's threads
+  std::call_once(owner_->event_loop_started_,
+                 [this]() { owner_->event_loop_ = std::make_unique<EventLoop>(owner_); });
+  return owner_->event_loop_.get();
+}
+
+ParallelPool* VM::GetParallelPool() {
+  std::call_once(owner_->parallel_pool_started_, [this]() {
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    owner_->parallel_pool_ = std::make_unique<ParallelPool>(owner_, threads);
+  });
+  return owner_->parallel_pool_.get();
+}
+
 void VM::Debug() {
   printf("     stack        ");
   for (auto slot = stack.begin(); slot < stack_top; ++slot) {
@@ -250,14 +668,32 @@ void VM::Debug() {
 
   auto frame = frame_pointer_ - 1;
 
-  int diff = std::distance(frame->closure->func->chunk->GetCodeBegin(), frame->ip);
-  disassembleInstruction(frame->closure->func->chunk.get(), diff);
+  int diff = frame->ip - frame->closure->func->code;
+  disassembleInstruction(frame->closure->func, diff);
 }
 
 InterpreteResult VM::Run() {
+  OverflowTrap trap{.regions = {&stack.Region(), &frames.Region()}};
+  EnterOverflowTrap(&trap);
+
+  if (sigsetjmp(trap.env, 0) != 0) {
+    LeaveOverflowTrap(&trap);
+
+    // the faulting push or call may already have moved past the end
+    stack_top = std::min(stack_top, stack.end());
+    frame_pointer_ = std::min(frame_pointer_, frames.end());
+    RuntimeError("Stack overflow.");
+    return InterpreteResult::RuntimeError;
+  }
+
+  auto result = Dispatch();
+  LeaveOverflowTrap(&trap);
+  return result;
+}
+
+InterpreteResult VM::Dispatch() {
   auto current_frame = frame_pointer_ - 1;
 
-  printf("\n======================= run trace ============================\n");
   for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
     Debug();
@@ -319,8 +755,11 @@ InterpreteResult VM::Run() {
       }
 
       case +OP_PRINT: {
+        // one line at a time when fibers print from several threads
+        flockfile(stdout);
         PrintValue(Pop());
         printf("\n");
+        funlockfile(stdout);
         break;
       }
 
@@ -330,11 +769,19 @@ InterpreteResult VM::Run() {
 
       case +OP_RETURN: {
         auto result = Pop();
-        CloseUpValue(current_frame->slots.base());
+        CloseUpValue(current_frame->slots);
+
+        if (auto generator = current_frame->generator) {
+          generator->done = true;
+          generator->running = false;
+          generator->slots = {};
+        }
+
         frame_pointer_--;
 
         if (frame_pointer_ == frames.begin()) {
           Pop();
+          return_value = result;
           return InterpreteResult::Ok;
         }
 
@@ -387,32 +834,273 @@ InterpreteResult VM::Run() {
 
       case +OP_DEFINE_GLOBAL: {
         auto name = ReadString();
-        // allow global variable redefine
-        globals.insert({name->hash, Pop()});
+        DefineGlobal(name, Pop());
+        break;
+      }
+
+      case +OP_INDEX_GET: {
+        Value result;
+        if (!GetIndex(Peek(1), Peek(0), &result)) return InterpreteResult::RuntimeError;
+
+        stack_top -= 2;
+        Push(result);
+        break;
+      }
+
+      case +OP_INDEX_SET: {
+        auto value = Peek(0);
+        if (!SetIndex(Peek(2), Peek(1), value)) return InterpreteResult::RuntimeError;
+
+        // the assignment's value
+        stack_top -= 3;
+        Push(value);
+        break;
+      }
+
+      case +OP_LIST: {
+        auto count = ReadByte();
+        auto list = new List;
+        list->values.assign(stack_top - count, stack_top);
+        InsertObject(list);
+
+        stack_top -= count;
+        Push(list);
+        break;
+      }
+
+      case +OP_MAP: {
+        auto count = ReadByte();
+        auto map = new Map;
+        InsertObject(map);
+
+        for (auto entry = stack_top - 2 * count; entry != stack_top; entry += 2) {
+          if (IsNumber(entry[0]) && std::isnan(AsNumber(entry[0]))) {
+            RuntimeError("Map keys can't be NaN.");
+            return InterpreteResult::RuntimeError;
+          }
+          map->table.Insert(entry[0], entry[1]);
+        }
+
+        stack_top -= 2 * count;
+        Push(map);
+        break;
+      }
+
+      case +OP_CLASS: {
+        auto klass = new Class(ReadString());
+        InsertObject(klass);
+        Push(klass);
+        break;
+      }
+
+      case +OP_INHERIT: {
+        if (!IsObjectType(Peek(1), ObjectType::Class)) {
+          RuntimeError("Superclass must be a class.");
+          return InterpreteResult::RuntimeError;
+        }
+
+        // copied down, the subclass's own methods then override them
+        auto superclass = AsClass(Peek(1));
+        auto subclass = AsClass(Peek(0));
+        subclass->methods = superclass->methods;
+        subclass->initializer = superclass->initializer;
+
+        Pop();
+        break;
+      }
+
+      case +OP_METHOD: {
+        auto name = ReadString();
+        auto klass = AsClass(Peek(1));
+        klass->methods[name->hash] = Peek(0);
+        if (name->GetString() == "init") klass->initializer = Peek(0);
+
+        Pop();
+        break;
+      }
+
+      case +OP_GET_PROPERTY: {
+        auto name = ReadString();
+        auto cache = &current_frame->closure->caches[ReadShort()];
+
+        if (!IsObjectType(Peek(0), ObjectType::Instance)) {
+          RuntimeError("Only instances have properties.");
+          return InterpreteResult::RuntimeError;
+        }
+
+        auto instance = AsInstance(Peek(0));
+        auto property = LookupProperty(instance, name, cache);
+        if (property->slot != -1) {
+          stack_top[-1] = instance->fields[property->slot];
+          break;
+        }
+
+        if (!BindMethod(instance->shape->klass, name)) return InterpreteResult::RuntimeError;
+        break;
+      }
+
+      case +OP_SET_PROPERTY: {
+        auto name = ReadString();
+        auto cache = &current_frame->closure->caches[ReadShort()];
+
+        if (!IsObjectType(Peek(1), ObjectType::Instance)) {
+          RuntimeError("Only instances have fields.");
+          return InterpreteResult::RuntimeError;
+        }
+
+        auto instance = AsInstance(Peek(1));
+        auto property = LookupProperty(instance, name, cache);
+        if (property->slot != -1) {
+          instance->fields[property->slot] = Peek(0);
+        } else {
+          // a new field goes at the end, and the instance moves to the shape that has it
+          auto shape = property->transition.load(std::memory_order_acquire);
+          if (shape == nullptr) shape = instance->shape->klass->Transition(property, name);
+
+          instance->fields.push_back(Peek(0));
+          instance->shape = shape;
+        }
+
+        // the assignment's value
+        stack_top[-2] = stack_top[-1];
+        stack_top--;
+        break;
+      }
+
+      case +OP_INVOKE: {
+        auto name = ReadString();
+        auto cache = &current_frame->closure->caches[ReadShort()];
+        int arg_count = ReadByte();
+
+        auto receiver = Peek(arg_count);
+        if (!IsObjectType(receiver, ObjectType::Instance)) {
+          RuntimeError("Only instances have methods.");
+          return InterpreteResult::RuntimeError;
+        }
+
+        auto instance = AsInstance(receiver);
+        auto property = LookupProperty(instance, name, cache);
+
+        Value callee = property->method;
+        if (property->slot != -1) {
+          // a field holding something callable, called without a receiver
+          callee = instance->fields[property->slot];
+          stack_top[-arg_count - 1] = callee;
+        } else if (IsNil(callee)) {
+          RuntimeError("Undefined property '%s'.", name->GetCString());
+          return InterpreteResult::RuntimeError;
+        }
+
+        if (!CallValue(callee, arg_count)) {
+          return InterpreteResult::RuntimeError;
+        }
+
+        // CallNative stepped back over an OP_CALL, retrying has to start
+        // again from this instruction with the receiver back in place
+        if (suspend == Suspend::Retry) {
+          current_frame->ip -= 3;
+          stack_top[-arg_count - 1] = receiver;
+        }
+
+        if (suspend != Suspend::None) return InterpreteResult::Suspended;
+
+        current_frame = frame_pointer_ - 1;
+        break;
+      }
+
+      case +OP_GET_SUPER: {
+        auto name = ReadString();
+        auto superclass = AsClass(Pop());
+
+        if (!BindMethod(superclass, name)) return InterpreteResult::RuntimeError;
+        break;
+      }
+
+      case +OP_SUPER_INVOKE: {
+        auto name = ReadString();
+        int arg_count = ReadByte();
+        auto superclass = AsClass(Pop());
+
+        auto iter = superclass->methods.find(name->hash);
+        if (iter == superclass->methods.end()) {
+          RuntimeError("Undefined property '%s'.", name->GetCString());
+          return InterpreteResult::RuntimeError;
+        }
+
+        if (!CallValue(iter->second, arg_count)) {
+          return InterpreteResult::RuntimeError;
+        }
+
+        if (suspend != Suspend::None) return InterpreteResult::Suspended;
+
+        current_frame = frame_pointer_ - 1;
+        break;
+      }
+
+      case +OP_INTRINSIC: {
+        auto intrinsic = ReadByte();
+        auto name = ReadString();
+        int arg_count = ReadByte();
+
+        auto args = std::addressof(*(stack_top - arg_count));
+        Value result;
+        if ((owner_->overridden_intrinsics_.load(std::memory_order_relaxed) & (1u << intrinsic)) == 0 &&
+            EvaluateIntrinsic(static_cast<Intrinsic>(intrinsic), arg_count, args, &result)) {
+          stack_top -= arg_count;
+          Push(result);
+          break;
+        }
+
+        // rebound, or arguments the intrinsic can't take: call the global as
+        // OP_GET_GLOBAL and OP_CALL would have
+        Value callee;
+        if (!GetGlobal(name, &callee)) {
+          RuntimeError("Undefined variable '%s'.", name->GetCString());
+          return InterpreteResult::RuntimeError;
+        }
+
+        std::copy_backward(stack_top - arg_count, stack_top, stack_top + 1);
+        stack_top[-arg_count] = callee;
+        stack_top++;
+
+        if (!CallValue(callee, arg_count)) {
+          return InterpreteResult::RuntimeError;
+        }
+
+        // CallNative stepped back over an OP_CALL, retrying has to start
+        // again from this instruction with the arguments as they were
+        if (suspend == Suspend::Retry) {
+          current_frame->ip -= 2;
+          std::copy(stack_top - arg_count, stack_top, stack_top - arg_count - 1);
+          stack_top--;
+        }
+
+        if (suspend != Suspend::None) return InterpreteResult::Suspended;
+
+        current_frame = frame_pointer_ - 1;
         break;
       }
 
       case +OP_GET_GLOBAL: {
         auto name = ReadString();
 
-        if (!globals.contains(name->hash)) {
+        Value value;
+        if (!GetGlobal(name, &value)) {
           RuntimeError("Undefined variable '%s'.", name->GetCString());
           return InterpreteResult::RuntimeError;
-        } else {
-          Push(globals[name->hash]);
         }
 
+        Push(value);
         break;
       }
 
       case +OP_SET_GLOBAL: {
         auto name = ReadString();
-        if (!globals.contains(name->hash)) {
+        if (!SetGlobal(name, Peek(0))) {
           RuntimeError("Undefined variable '%s'.", name->GetCString());
           return InterpreteResult::RuntimeError;
         }
 
-        globals[name->hash] = Peek(0);
         break;
       }
 
@@ -430,34 +1118,47 @@ InterpreteResult VM::Run() {
 
       case +OP_SET_UPVALUE: {
         auto slot = ReadByte();
-        *current_frame->closure->upvalues[slot]->location = Peek(0);
+        *current_frame->closure->Upvalues()[slot]->location = Peek(0);
         break;
       }
 
       case +OP_GET_UPVALUE: {
         auto slot = ReadByte();
-        Push(*current_frame->closure->upvalues[slot]->location);
+        Push(*current_frame->closure->Upvalues()[slot]->location);
+        break;
+      }
+
+      case +OP_GET_CAPTURED: {
+        auto slot = ReadByte();
+        Push(current_frame->closure->Captured()[slot]);
         break;
       }
 
       case +OP_CLOSE_UPVALUE: {
-        CloseUpValue((stack_top - 1).base());
+        CloseUpValue(stack_top - 1);
         Pop();
         break;
       }
 
       case +OP_CLOSURE: {
         Function* function = reinterpret_cast<Function*>(std::get<Object*>(ReadConstant()));
-        Closure* closure = new Closure(function);
+        Closure* closure = Closure::New(function);
+        InsertObject(closure);
+        // pushed first, so a local function copying its own variable gets itself
         Push(closure);
-        for (int i = 0; i < closure->upvalues.size(); i++) {
-          uint8_t is_local = ReadByte();
+        int upvalue = 0, captured = 0;
+        for (int i = 0; i < function->upvalue_count + function->captured_count; i++) {
+          uint8_t kind = ReadByte();
           uint8_t index = ReadByte();
 
-          if (is_local) {
-            closure->upvalues[i] = CaptureUpvalue(&current_frame->slots[index]);
+          if (kind & kCaptureByValue) {
+            auto& enclosing = current_frame->closure;
+            closure->Captured()[captured++] =
+                (kind & kCaptureLocal) ? current_frame->slots[index] : enclosing->Captured()[index];
+          } else if (kind & kCaptureLocal) {
+            closure->Upvalues()[upvalue++] = CaptureUpvalue(&current_frame->slots[index]);
           } else {
-            closure->upvalues[i] = current_frame->closure->upvalues[i];
+            closure->Upvalues()[upvalue++] = current_frame->closure->Upvalues()[index];
           }
         }
         break;
@@ -493,12 +1194,26 @@ InterpreteResult VM::Run() {
         break;
       }
 
+      case +OP_YIELD: {
+        if (current_frame->generator == nullptr) {
+          RuntimeError("Can only yield from a generator.");
+          return InterpreteResult::RuntimeError;
+        }
+
+        Yield(Pop());
+        current_frame = frame_pointer_ - 1;
+        break;
+      }
+
       case +OP_CALL: {
         int arg_count = ReadByte();
         if (!CallValue(Peek(arg_count), arg_count)) {
           return InterpreteResult::RuntimeError;
         }
 
+        // resuming continues after the call, with the native's result in place
+        if (suspend != Suspend::None) return InterpreteResult::Suspended;
+
         // change to call frame
         current_frame = frame_pointer_ - 1;
         break;
@@ -1,8 +1,11 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -10,6 +13,8 @@
 #include <vector>
 
 #include "chunk.h"
+#include "heap.h"
+#include "stack.h"
 #include "table.h"
 #include "value.h"
 
@@ -17,39 +22,89 @@ enum class InterpreteResult {
   Ok,
   CompilerError,
   RuntimeError,
+  // only returned by Run, when a native suspended the running code
+  Suspended,
 };
 
-class VM {
+class CompiledProgram;
+struct Class;
+struct Instance;
+struct Fiber;
+class Scheduler;
+class EventLoop;
+class ParallelPool;
+struct IoRequest;
+
+class VM : public Heap {
  public:
-  inline static constexpr int FRAMES_MAX = 64;
-  inline static constexpr int STACK_MAX = FRAMES_MAX * UINT8_MAX;
+  // address space reserved for the stacks, pages are only backed once a
+  // deep enough call touches them
+  inline static constexpr int FRAMES_MAX = 1 << 16;
+  inline static constexpr int STACK_MAX = 1 << 22;
 
   struct CallFrame {
     Closure* closure{};
-    std::vector<uint8_t>::iterator ip;
-    std::vector<Value>::iterator slots;
+    const uint8_t* ip{};
+    Value* slots{};
+    // set while the frame runs a resumed generator
+    Generator* generator{};
+  };
+
+  // Upvalues still pointing into a stack, indexed by slot so capturing is a
+  // lookup, with a bit per slot so closing a frame only visits slots that
+  // have one. Grown to cover the highest slot captured so far.
+  struct OpenUpvalues {
+    std::vector<Upvalue*> slots;
+    std::vector<uint64_t> bits;
+    int count{};
   };
 
+  using Globals = std::unordered_map<size_t, Value>;
+
   VM();
 
-  std::vector<Value> stack;
-  std::vector<Value>::iterator stack_top;
+  // A worker VM runs fibers for owner. It shares the owner's globals and
+  // natives but has its own heap and execution state.
+  explicit VM(VM* owner);
+
+  ~VM();
 
-  Object* objects{};
+  // running off either stack faults on its guard page, which Run turns into
+  // a stack overflow error
+  Stack<Value> stack;
+  Value* stack_top;
 
-  std::unordered_map<size_t, Value> globals;
-  std::unordered_map<size_t, String*> strings;
+ private:
+  Globals own_globals_;
 
-  std::vector<CallFrame> frames;
-  std::vector<CallFrame>::iterator frame_pointer_;
+ public:
+  Globals& globals;
+
+  Stack<CallFrame> frames;
+  CallFrame* frame_pointer_;
+
+  OpenUpvalues open_upvalues;
 
-  Upvalue* open_upvalues;
+  // what the outermost frame returned when Run finished
+  Value return_value;
+
+  // set by a native to suspend the running code once the native returns
+  // Retry leaves the native's arguments in place and calls it again on resume
+  enum class Suspend { None, Yield, Join, Io, Retry };
+  Suspend suspend{};
+  Fiber* join_target{};
+  IoRequest* io_request{};
 
   InterpreteResult Run();
 
+  // Run, then wait out anything a native suspended the code for; only for
+  // VMs that aren't running fibers
+  InterpreteResult RunToCompletion();
+
   void ResetStack() {
     stack_top = stack.begin();
-    objects = nullptr;
+    frame_pointer_ = frames.begin();
+    open_upvalues = {};
   }
 
   uint8_t ReadByte();
@@ -66,10 +121,66 @@ class VM {
 
   bool CallValue(Value callee, int arg_count);
 
+  // calling a generator function only captures its arguments
+  bool NewGenerator(Closure* closure, int arg_count);
+
+  bool Resume(Generator* generator, int arg_count);
+
+  // suspends the generator running in the innermost frame
+  void Yield(Value value);
+
+  // what name means on instance, from the site's cache when its shape matches
+  Property* LookupProperty(Instance* instance, String* name, std::atomic<Property*>* cache);
+
+  // replaces the receiver on top of the stack with klass's method bound to it
+  bool BindMethod(Class* klass, String* name);
+
+  Upvalue* CaptureUpvalue(Value* local);
+
+  // adds an upvalue whose location is on the stack to the open ones
+  void OpenUpvalue(Upvalue* upvalue);
+
+  void CloseUpValue(Value* last);
+
+  // calls f on each open upvalue from first up to the stack top and removes
+  // it from the open ones
+  template <typename F>
+  void TakeOpenUpvalues(Value* first, F f);
+
   void RuntimeError(const char* format, ...);
 
   void Concatenate();
 
+  // target[index] of a list, map or array, false after a runtime error
+  bool GetIndex(Value target, Value index, Value* result);
+  bool SetIndex(Value target, Value index, Value value);
+
+  bool GetGlobal(String* name, Value* value);
+
+  // false if the global doesn't exist
+  bool SetGlobal(String* name, Value value);
+
+  void DefineGlobal(String* name, Value value);
+
+  // works out again which intrinsics' globals were rebound, after the globals
+  // were replaced wholesale
+  void RefreshIntrinsics();
+
+  // exchanges the VM's execution state with the one saved in fiber
+  void SwapState(Fiber* fiber);
+
+  // the owner's scheduler, started by the first spawn
+  Scheduler* GetScheduler();
+
+  // the owner's event loop, started by the first async native
+  EventLoop* GetEventLoop();
+
+  // the owner's pool for parallelFor and parallelReduce, started on first use
+  ParallelPool* GetParallelPool();
+
+  // true for the VMs a scheduler or parallel pool runs code on
+  bool IsWorker() const { return owner_ != this; }
+
   void Push(Value value) {
     *stack_top = value;
     stack_top++;
@@ -83,31 +194,50 @@ class VM {
   Value Peek(int distance) { return stack_top[-1 - distance]; }
 
  public:
-  Value AllocateString(std::string_view str) {
-    size_t hash = std::hash<std::string_view>{}(str);
+  // line is where source starts in its file, for streamed declarations
+  InterpreteResult Interpret(std::string_view source, int line = 1);
 
-    if (!strings.contains(hash)) {
-      return strings[hash];
-    }
+  // runs a program compiled elsewhere; its objects stay owned by the program
+  InterpreteResult Interpret(const CompiledProgram& program);
 
-    String* string = new String;
-    string->content = new char[str.length() + 1];
-    std::copy(str.begin(), str.end(), string->content);
-    string->content[str.length()] = '\0';
+  InterpreteResult Execute(Function* function);
 
-    InsertObject(string);
+  void DefineNativeFunction(const char* name, NativeFunctor func);
 
-    return string;
-  }
+  // a plain function is called without going through std::function, and
+  // unless arity is -1 the VM checks argc before calling it
+  void DefineNativeFunction(const char* name, NativeFn func, int arity = -1);
 
-  InterpreteResult Interpret(const char* source);
+  void Debug();
 
-  static VM* GetInstance() {
-    static VM vm;
-    return &vm;
-  }
+ private:
+  VM* owner_;
 
-  void Debug();
+  // rebinding a global that holds an intrinsic's native turns its opcode
+  // into a plain call
+  void CheckIntrinsic(Value value);
+
+  // a bit per Intrinsic whose global no longer holds its native, kept by the
+  // owner for every VM sharing its globals
+  std::atomic<uint32_t> overridden_intrinsics_{};
+
+  // points at the owner's globals_mutex_ once code may run on other threads
+  std::shared_mutex globals_mutex_;
+  std::shared_mutex* globals_lock_{};
+
+  std::once_flag event_loop_started_;
+  std::unique_ptr<EventLoop> event_loop_;
+
+  std::once_flag parallel_pool_started_;
+  std::unique_ptr<ParallelPool> parallel_pool_;
+
+  // declared last so its workers stop before anything else is destroyed,
+  // fibers may still be waiting on the event loop until then
+  std::unique_ptr<Scheduler> scheduler_;
+
+  // Run without the overflow trap
+  InterpreteResult Dispatch();
 
-  void InsertObject(Object* object);
+  friend class Scheduler;
+  friend class ParallelPool;
 };